@@ -0,0 +1,174 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "addrconf.h"
+
+
+namespace harddns {
+
+using namespace std;
+
+
+addr_config::~addr_config()
+{
+	if (d_nl >= 0)
+		close(d_nl);
+}
+
+
+// Subscribe to address changes. Done before scanning, so no change is missed in between.
+// A child after fork() shares the socket with its parent and needs its own.
+void addr_config::open_netlink(pid_t pid)
+{
+	if (d_nl >= 0 && d_pid == pid)
+		return;
+	if (d_nl >= 0)
+		close(d_nl);
+
+	d_pid = pid;
+	d_valid = 0;
+
+	if ((d_nl = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC|SOCK_NONBLOCK, NETLINK_ROUTE)) < 0)
+		return;
+
+	sockaddr_nl snl;
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_IPV4_IFADDR|RTMGRP_IPV6_IFADDR;
+
+	if (::bind(d_nl, reinterpret_cast<sockaddr *>(&snl), sizeof(snl)) < 0) {
+		close(d_nl);
+		d_nl = -1;
+	}
+}
+
+
+// Drain the pending notifications, without looking into them. An overrun
+// queue means we missed some.
+bool addr_config::changed()
+{
+	char buf[4096];
+	bool r = 0;
+
+	for (;;) {
+		ssize_t n = recv(d_nl, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n > 0 || (n < 0 && errno == ENOBUFS))
+			r = 1;
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else
+			break;
+	}
+
+	return r;
+}
+
+
+void addr_config::scan()
+{
+	ifaddrs *ifa = nullptr;
+
+	d_valid = 1;
+	d_next_scan = time(nullptr) + rescan_secs;
+
+	// if we can't tell, ask for everything
+	if (getifaddrs(&ifa) < 0) {
+		d_v4 = d_v6 = 1;
+		return;
+	}
+
+	// lookups see the old flags until both are known
+	bool v4 = 0, v6 = 0;
+	for (ifaddrs *i = ifa; i; i = i->ifa_next) {
+		if (!i->ifa_addr || !(i->ifa_flags & IFF_UP) || (i->ifa_flags & IFF_LOOPBACK))
+			continue;
+		if (i->ifa_addr->sa_family == AF_INET) {
+			auto sin = reinterpret_cast<sockaddr_in *>(i->ifa_addr);
+			if ((ntohl(sin->sin_addr.s_addr) >> 24) != 127)
+				v4 = 1;
+		} else if (i->ifa_addr->sa_family == AF_INET6) {
+			auto sin6 = reinterpret_cast<sockaddr_in6 *>(i->ifa_addr);
+			if (!IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr) && !IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
+				v6 = 1;
+		}
+	}
+
+	freeifaddrs(ifa);
+
+	d_v4 = v4;
+	d_v6 = v6;
+}
+
+
+void addr_config::update(pid_t pid)
+{
+	open_netlink(pid);
+
+	if (d_nl >= 0) {
+		if (changed())
+			d_valid = 0;
+	} else if (time(nullptr) >= d_next_scan)
+		d_valid = 0;
+
+	if (!d_valid)
+		scan();
+}
+
+
+// Like AI_ADDRCONFIG: leave out the family the host has no address of, unless it has
+// neither, in which case both are asked as if we didn't know. A is always asked if
+// AAAA is not wanted.
+void addr_config::families(bool &want_a, bool &want_aaaa)
+{
+	time_t now = time(nullptr);
+
+	if (now >= d_next_check.load(memory_order_relaxed)) {
+		pid_t pid = getpid(), other = d_updating.load();
+
+		// nobody else of this process is at it
+		if (other != pid && d_updating.compare_exchange_strong(other, pid)) {
+			update(pid);
+			d_next_check = now + check_secs;
+			d_updating = 0;
+		}
+	}
+
+	bool v4 = d_v4, v6 = d_v6, any = v4 || v6;
+
+	want_aaaa = want_aaaa && (v6 || !any);
+	want_a = !want_aaaa || v4 || !any;
+}
+
+
+}
+
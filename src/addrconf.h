@@ -0,0 +1,82 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef harddns_addrconf_h
+#define harddns_addrconf_h
+
+#include <atomic>
+#include <ctime>
+#include <sys/types.h>
+
+
+namespace harddns {
+
+
+// Which address families the host has usable addresses of, as with AI_ADDRCONFIG:
+// anything but loopback, and for IPv6 link-local. Scanned on first use and again
+// once the kernel announced an address change via netlink, or every rescan_secs
+// if that is not available. Lookups only read the flags; netlink is looked at
+// no more than every check_secs, by one thread while the others go on.
+class addr_config {
+
+	int d_nl{-1};
+
+	pid_t d_pid{0};
+
+	bool d_valid{0};
+
+	std::atomic<bool> d_v4{1}, d_v6{1};
+
+	// pid of the process one of whose threads is updating, or 0. A child after
+	// fork() may find its parent's there, which it takes over.
+	std::atomic<pid_t> d_updating{0};
+
+	std::atomic<time_t> d_next_check{0};
+
+	time_t d_next_scan{0};
+
+	enum { check_secs = 1, rescan_secs = 60 };
+
+	void open_netlink(pid_t);
+
+	bool changed();
+
+	void scan();
+
+	void update(pid_t);
+
+public:
+
+	addr_config()
+	{
+	}
+
+	virtual ~addr_config();
+
+	// whether to ask for A and AAAA, given whether AAAA is wanted at all
+	void families(bool &, bool &);
+};
+
+
+}
+
+#endif
+
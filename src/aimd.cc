@@ -0,0 +1,110 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <mutex>
+#include <string>
+#include "aimd.h"
+
+
+namespace harddns {
+
+using namespace std;
+
+
+aimd *upstream_limits = nullptr;
+
+
+// Start low, as provider side throttling is what we want to avoid.
+// A reply slower than spike_factor times the base RTT counts as congestion.
+static const double initial_limit = 4, backoff_error = 0.5, backoff_spike = 0.7, spike_factor = 2;
+
+
+// Take an in-flight slot of ns. Returns 0 if ns is at its limit, unless force is
+// given, which is for the last nameserver to try.
+bool aimd::acquire(const string &ns, bool force)
+{
+	lock_guard<mutex> g(d_mtx);
+
+	auto it = d_state.find(ns);
+	if (it == d_state.end())
+		it = d_state.insert({ns, {initial_limit, 0, 0, 0, 0}}).first;
+
+	state_t &st = it->second;
+	if (!force && st.inflight >= (unsigned int)st.limit)
+		return 0;
+
+	++st.inflight;
+	return 1;
+}
+
+
+// Give back the slot of ns, taken by acquire(), with the outcome and RTT in usec
+// of the request.
+void aimd::release(const string &ns, bool ok, long rtt)
+{
+	lock_guard<mutex> g(d_mtx);
+
+	auto it = d_state.find(ns);
+	if (it == d_state.end())
+		return;
+
+	state_t &st = it->second;
+	if (st.inflight > 0)
+		--st.inflight;
+
+	// cut at most once per window of replies, as the replies of requests that were
+	// sent before the last cut still see the same congestion
+	bool may_cut = ++st.since_cut >= (unsigned int)st.limit;
+
+	if (!ok) {
+		if (may_cut) {
+			st.limit *= backoff_error;
+			st.since_cut = 0;
+		}
+	} else {
+		double r = rtt > 0 ? rtt : 1;
+
+		st.srtt = st.srtt > 0 ? (7*st.srtt + r)/8 : r;
+
+		// lowest RTT seen, slowly following upwards in case the path changed
+		if (st.base_rtt <= 0 || r < st.base_rtt)
+			st.base_rtt = r;
+		else
+			st.base_rtt += (r - st.base_rtt)/64;
+
+		if (st.srtt > spike_factor*st.base_rtt) {
+			if (may_cut) {
+				st.limit *= backoff_spike;
+				st.since_cut = 0;
+			}
+		} else
+			st.limit += 1/st.limit;
+	}
+
+	if (st.limit < 1)
+		st.limit = 1;
+	if (st.limit > d_max)
+		st.limit = d_max;
+}
+
+
+}
+
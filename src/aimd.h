@@ -0,0 +1,70 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_aimd_h
+#define harddns_aimd_h
+
+#include <map>
+#include <mutex>
+#include <string>
+
+
+namespace harddns {
+
+
+// Adaptive in-flight limit per nameserver: grows additively as long as the latency
+// stays flat and shrinks multiplicatively on errors or latency spikes. Requests to a
+// nameserver at its limit are meant to go to another one.
+class aimd {
+
+	struct state_t {
+		double limit, base_rtt, srtt;
+		unsigned int inflight, since_cut;
+	};
+
+	std::mutex d_mtx;
+
+	std::map<std::string, state_t> d_state;
+
+	unsigned int d_max{32};
+
+public:
+
+	aimd(unsigned int max = 32)
+		: d_max(max < 1 ? 1 : max)
+	{
+	}
+
+	virtual ~aimd()
+	{
+	}
+
+	bool acquire(const std::string &, bool force = 0);
+
+	void release(const std::string &, bool, long);
+};
+
+
+extern aimd *upstream_limits;
+
+}
+
+#endif
+
@@ -0,0 +1,436 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark of dnshttps::parse_rfc8484() against the parser it replaced,
+// which copied the message and walked the answers twice with lowercased name strings.
+//
+// Runs over the raw DNS answers given as files, e.g. saved from a DoH server via
+//   curl -H 'accept: application/dns-message' 'https://dns.google/dns-query?dns=...' > a.bin
+// or else over the built-in answers below, which have the shape of what the public
+// resolvers return to harddns' queries: CDN names with CNAME chains whose owner names
+// are compression pointers into the RDATA of the record before. The ones marked EDNS
+// answer EDNS queries and end in an OPT record padded to 468 bytes (rfc8467), which
+// the old parser took as invalid, so they show up as differing.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include "dnshttps.h"
+#include "dnsmsg.h"
+#include "misc.h"
+#include "net-headers.h"
+
+
+using namespace std;
+using namespace harddns;
+using namespace net_headers;
+
+
+static const char *builtin[] = {
+	// www.microsoft.com A
+	"00008180000100040000000003777777096d6963726f736f667403636f6d0000010001c00c0005000100000e10002303"
+	"777777096d6963726f736f667407636f6d2d632d3307656467656b6579036e657400c02f000500010000038400370377"
+	"7777096d6963726f736f667407636f6d2d632d3307656467656b6579036e65740b676c6f62616c726564697206616b61"
+	"646e73c04dc05e000500010000038400190665313336373804647363620a616b616d616965646765c04dc0a100010001"
+	"000000140004172de5ab",
+	// www.amazon.com A
+	"0000818000010006000000000377777706616d617a6f6e03636f6d0000010001c00c0005000100000708001802747012"
+	"3437636632633863392d66726f6e74696572c010c02c000500010000003c001f0e643361673468756b6b683632796e0a"
+	"636c6f756466726f6e74036e657400c050000100010000003c000412a55307c050000100010000003c000412a55329c0"
+	"50000100010000003c000412a55357c050000100010000003c000412a55370",
+	// www.google.com AAAA
+	"0000818000010001000000000377777706676f6f676c6503636f6d00001c0001c00c001c00010000012c00102a001450"
+	"4001082b0000000000002004",
+	// github.com A
+	"0000818000010001000000000667697468756203636f6d0000010001c00c000100010000003c00048c527904",
+	// www.wikipedia.org AAAA
+	"000081800001000200000000037777770977696b697065646961036f726700001c0001c00c0005000100015180001104"
+	"64796e610977696b696d65646961c01ac02f001c00010000025800102a02ec800300ed1a0000000000000001",
+	// www.apple.com A, EDNS, padded to 468 bytes
+	"00008180000100040000000103777777056170706c6503636f6d0000010001c00c000500010000012c001b0377777705"
+	"6170706c6503636f6d07656467656b6579036e657400c02b0005000100005460002f03777777056170706c6503636f6d"
+	"07656467656b6579036e65740b676c6f62616c726564697206616b61646e73c041c0520005000100000e100018056536"
+	"38353804647363780a616b616d616965646765c041c08d0001000100000014000417d406b400002904d0000000000114"
+	"000c01100000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000",
+	// www.netflix.com A, EDNS, padded to 468 bytes
+	"00008180000100060000000103777777076e6574666c697803636f6d0000010001c00c000500010000012c000d037777"
+	"7706647261646973c010c02d000500010000003c0019037777770975732d776573742d3208696e7465726e616cc031c0"
+	"46000500010000003c00472c61706970726f78792d776562736974652d6e6c622d70726f642d312d6263663238643231"
+	"663462626366326303656c620975732d776573742d3209616d617a6f6e617773c018c06b000100010000003c00042cf2"
+	"3c55c06b000100010000003c000434260753c06b000100010000003c00042cedea1900002904d00000000000e7000c00"
+	"e30000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000",
+	// www.cnn.com AAAA, EDNS, padded to 468 bytes
+	"0000818000010005000000010377777703636e6e03636f6d00001c0001c00c000500010000012c001807636e6e2d746c"
+	"73036d617006666173746c79036e657400c029001c00010000001e00102a044e42000000000000000000000773c02900"
+	"1c00010000001e00102a044e42020000000000000000000773c029001c00010000001e00102a044e4204000000000000"
+	"0000000773c029001c00010000001e00102a044e4206000000000000000000077300002904d0000000000118000c0114"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000",
+	// www.ebay.com A, EDNS, padded to 468 bytes
+	"00008180000100040000000103777777046562617903636f6d0000010001c00c0005000100000e10001f08736c6f7439"
+	"343238046562617903636f6d07656467656b6579036e657400c02a0005000100005460001505653934323801610a616b"
+	"616d616965646765c044c055000100010000001400040213982ec055000100010000001400040213982300002904d000"
+	"000000013f000c013b000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000",
+	// www.yahoo.com A, EDNS, padded to 468 bytes
+	"00008180000100030000000103777777057961686f6f03636f6d0000010001c00c000500010000003c00210e6d652d79"
+	"6370692d63662d77777703673036087961686f6f646e73036e657400c02b000100010000003c000457f864d7c02b0001"
+	"00010000003c000457f864d800002904d000000000015d000c0159000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+	"000000000000000000000000000000000000000000000000000000000000000000000000",
+	// nonexistent.example.com A, NXDOMAIN
+	"0000818300010000000100000b6e6f6e6578697374656e74076578616d706c6503636f6d0000010001c0180006000100"
+	"000e10002c026e73056963616e6e036f726700036e6f6303646e73c03878a507bc00001c2000000e100012750000000e"
+	"10",
+};
+
+
+static string unhex(const char *hex)
+{
+	string r = "";
+	for (; hex[0] && hex[1]; hex += 2)
+		r += (char)strtoul(string(hex, 2).c_str(), nullptr, 16);
+	return r;
+}
+
+
+static int read_file(const char *path, string &msg)
+{
+	char buf[4096];
+	ssize_t r = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	msg = "";
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		msg += string(buf, r);
+	close(fd);
+	return r < 0 ? -1 : 0;
+}
+
+
+static string err = "";
+
+
+// as dnshttps::build_error(), so that failing answers cost the same on both sides
+template<class T>
+static T build_error(const string &msg, T r)
+{
+	err = "dnshttps::";
+	err += msg;
+	if (errno) {
+		err += ":";
+		err += strerror(errno);
+	}
+	return r;
+}
+
+
+// The parser before dns_msg, without the HTTP chunked decoding.
+// It started by copying the body out of the HTTP reply.
+static int old_parse_rfc8484(const string &name, uint16_t type, dnshttps::dns_reply &result, const string &reply)
+{
+	string dns_reply = reply, tmp = "";
+	string::size_type idx = string::npos, aidx = string::npos;
+	bool has_answer = 0;
+	unsigned int acnt = 0;
+
+	if (dns_reply.size() < sizeof(dnshdr) + 5)
+		return build_error("Invalid reply (4).", -1);
+
+	const dnshdr *dhdr = reinterpret_cast<const dnshdr *>(dns_reply.c_str());
+
+	if (dhdr->qr != 1)
+		return build_error("Invalid DNS header. Not a reply.", -1);
+
+	if (dhdr->rcode != 0)
+		return build_error("DNS error response from server.", 0);
+
+	string aname = "", cname = "", fqdn = "";
+	idx = sizeof(dnshdr);
+	int qnlen = qname2host(dns_reply, tmp, idx);
+	if (qnlen <= 0 || idx + qnlen + 2*sizeof(uint16_t) >= dns_reply.size())
+		return build_error("Invalid reply (5).", -1);
+	fqdn = lcs(tmp);
+	if (lcs(string(name + ".")) != fqdn)
+		return build_error("Wrong name in awnser.", -1);
+
+	idx += qnlen + 2*sizeof(uint16_t);
+	aidx = idx;
+
+	uint16_t rdlen = 0, qtype = 0, qclass = 0;
+	uint32_t ttl = 0;
+
+	// first of all, find all CNAMEs for desired name
+	map<string, int> fqdns{{fqdn, 1}};
+
+	for (int i = 0;; ++i) {
+		if (idx >= dns_reply.size())
+			break;
+
+		if ((qnlen = qname2host(dns_reply, tmp, idx)) <= 0)
+			return build_error("Invalid reply (6).", -1);
+		aname = lcs(tmp);
+
+		if (idx + qnlen + 10 >= dns_reply.size())
+			return build_error("Invalid reply (7).", -1);
+		idx += qnlen;
+		qtype = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
+		idx += sizeof(uint16_t);
+		qclass = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
+		idx += sizeof(uint16_t);
+		ttl = *reinterpret_cast<const uint32_t *>(dns_reply.c_str() + idx);
+		idx += sizeof(uint32_t);
+		rdlen = ntohs(*reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx));
+		idx += sizeof(uint16_t);
+
+		if (idx + rdlen > dns_reply.size() || qclass != htons(1) || rdlen == 0)
+			return build_error("Invalid reply (8).", -1);
+
+		if (qtype == htons(dns_type::CNAME)) {
+			if (qname2host(dns_reply, tmp, idx) <= 0)
+				return build_error("Invalid reply (9).", -1);
+			cname = lcs(tmp);
+
+			if (fqdns.count(aname) > 0) {
+				fqdns[cname] = 1;
+				result[acnt++] = {"NSS CNAME", 0, 0, ntohl(ttl), cname};
+			}
+		}
+
+		idx += rdlen;
+	}
+
+	idx = aidx;
+	for (int i = 0;; ++i) {
+		if (idx >= dns_reply.size())
+			break;
+
+		if ((qnlen = qname2host(dns_reply, aname, idx)) <= 0)
+			return build_error("Invalid reply (10).", -1);
+
+		if (idx + qnlen + 10 >= dns_reply.size())
+			return build_error("Invalid reply (11).", -1);
+		idx += qnlen;
+		qtype = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
+		idx += sizeof(uint16_t);
+		qclass = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
+		idx += sizeof(uint16_t);
+		ttl = *reinterpret_cast<const uint32_t *>(dns_reply.c_str() + idx);
+		idx += sizeof(uint32_t);
+		rdlen = ntohs(*reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx));
+		idx += sizeof(uint16_t);
+
+		if (idx + rdlen > dns_reply.size() || qclass != htons(1) || rdlen == 0)
+			return build_error("Invalid reply (12).", -1);
+
+		string qname = "";
+		if (host2qname(aname, qname) <= 0)
+			return build_error("Invalid reply (13).", -1);
+
+		dnshttps::answer_t dns_ans{qname, qtype, qclass, ttl};
+
+		if (qtype == htons(dns_type::A) && fqdns.count(lcs(aname)) > 0) {
+			if (rdlen != 4)
+				return build_error("Invalid reply.", -1);
+			dns_ans.rdata = dns_reply.substr(idx, 4);
+			result[acnt++] = dns_ans;
+			has_answer = 1;
+		} else if (qtype == htons(dns_type::AAAA) && fqdns.count(lcs(aname)) > 0) {
+			if (rdlen != 16)
+				return build_error("Invalid reply (14).", -1);
+			dns_ans.rdata = dns_reply.substr(idx, 16);
+			result[acnt++] = dns_ans;
+			has_answer = 1;
+		} else if (qtype == htons(dns_type::CNAME)) {
+			string qcname = "";
+			if (qname2host(dns_reply, cname, idx) <= 0)
+				return build_error("Invalid reply (15).", -1);
+			if (host2qname(cname, qcname) <= 0)
+				return build_error("Invalid reply (16).", -1);
+			dns_ans.rdata = qcname;
+			result[acnt++] = dns_ans;
+		} else if ((qtype == htons(dns_type::NS) || qtype == htons(dns_type::MX)) && qtype == type) {
+			dns_ans.rdata = dns_reply.substr(idx, rdlen);
+			result[acnt++] = dns_ans;
+			has_answer = 1;
+		}
+
+		idx += rdlen;
+	}
+
+	return has_answer ? 1 : 0;
+}
+
+
+// The old parser added all "NSS CNAME" entries before the records, the new one adds each
+// right before its CNAME record. Same answer if both kinds come in the same order.
+static bool same(const dnshttps::dns_reply &a, const dnshttps::dns_reply &b)
+{
+	vector<const dnshttps::answer_t *> ea[2], eb[2];
+
+	for (auto &e : a)
+		ea[e.second.name.find("NSS ") == 0].push_back(&e.second);
+	for (auto &e : b)
+		eb[e.second.name.find("NSS ") == 0].push_back(&e.second);
+
+	for (int k = 0; k < 2; ++k) {
+		if (ea[k].size() != eb[k].size())
+			return 0;
+		for (size_t i = 0; i < ea[k].size(); ++i) {
+			const dnshttps::answer_t &x = *ea[k][i], &y = *eb[k][i];
+			if (x.name != y.name || x.qtype != y.qtype || x.qclass != y.qclass || x.ttl != y.ttl || x.rdata != y.rdata)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
+static double now_ns()
+{
+	timespec ts = {0, 0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned long n = 200000;
+	int c = 0;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = strtoul(optarg, nullptr, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] [answer files]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	vector<pair<string, string>> answers;
+	if (optind < argc) {
+		for (int i = optind; i < argc; ++i) {
+			string msg = "";
+			if (read_file(argv[i], msg) < 0) {
+				perror(argv[i]);
+				return 1;
+			}
+			answers.push_back({argv[i], msg});
+		}
+	} else {
+		for (auto hex : builtin)
+			answers.push_back({"", unhex(hex)});
+	}
+
+	dnshttps d(nullptr);
+	double old_total = 0, new_total = 0;
+
+	printf("%-28s %5s %8s %12s %12s %7s\n", "answer", "qtype", "records", "old ns/op", "new ns/op", "speedup");
+
+	for (auto &a : answers) {
+		dns_msg msg(a.second);
+		string::size_type qname = 0;
+		uint16_t qtype = 0, qclass = 0;
+		string name = "", raw = "";
+
+		if (msg.question(qname, qtype, qclass) == string::npos || msg.expand_host(qname, name) <= 0) {
+			printf("%-28s no valid question, skipped\n", a.first.c_str());
+			continue;
+		}
+		if (name.size() > 1)
+			name.pop_back();
+		if (a.first.empty())
+			a.first = name;
+
+		dnshttps::dns_reply old_res, new_res;
+		int old_r = old_parse_rfc8484(name, qtype, old_res, a.second);
+		int new_r = d.parse_rfc8484(name, qtype, new_res, raw, a.second);
+
+		unsigned long sink = 0;
+
+		double start = now_ns();
+		for (unsigned long i = 0; i < n; ++i) {
+			dnshttps::dns_reply res;
+			old_parse_rfc8484(name, qtype, res, a.second);
+			sink += res.size();
+		}
+		double old_ns = (now_ns() - start)/n;
+
+		start = now_ns();
+		for (unsigned long i = 0; i < n; ++i) {
+			dnshttps::dns_reply res;
+			d.parse_rfc8484(name, qtype, res, raw, a.second);
+			sink += res.size();
+		}
+		double new_ns = (now_ns() - start)/n;
+
+		old_total += old_ns;
+		new_total += new_ns;
+
+		printf("%-28s %5u %8zu %12.0f %12.0f %6.2fx%s\n", a.first.c_str(), ntohs(qtype), new_res.size(), old_ns, new_ns,
+		       old_ns/new_ns, old_r != new_r || !same(old_res, new_res) ? "  (results differ)" : "");
+
+		// keep the loops from being optimized away
+		if (sink == 1)
+			printf("\n");
+	}
+
+	if (new_total > 0)
+		printf("%-28s %5s %8s %12.0f %12.0f %6.2fx\n", "total", "", "", old_total, new_total, old_total/new_total);
+
+	return 0;
+}
+
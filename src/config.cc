@@ -47,7 +47,22 @@ map<string, struct a_ns_cfg> *ns_cfg = nullptr;
 // map internal domain to internal NS IP
 map<string, string> internal_domains;
 
-bool log_requests = 0, nss_aaaa = 0, cache_PTR = 0;
+// if set, where to keep TLS sessions across processes
+string tls_session_dir = "";
+
+string nss_socket = "", shm_cache = "";
+
+unsigned int warm_connections = 0, keepalive = 20;
+
+unsigned int max_inflight = 32;
+
+unsigned int nss_cache = 0, nss_contexts = 4;
+
+list<string> shadow_ns;
+
+unsigned int shadow_rate = 5;
+
+bool log_requests = 0, nss_aaaa = 0, nss_addrconfig = 1, cache_PTR = 0, passthrough = 0, ktls = 0, select_hash = 0;
 
 
 int parse_config(const string &cfgbase)
@@ -79,16 +94,73 @@ int parse_config(const string &cfgbase)
 			config::log_requests = 1;
 		else if (sline.find("nss_aaaa") == 0)
 			config::nss_aaaa = 1;
+		else if (sline.find("nss_addrconfig=0") == 0)
+			config::nss_addrconfig = 0;
+		else if (sline.find("nss_cache=") == 0)
+			config::nss_cache = strtoul(sline.c_str() + 10, nullptr, 10);
+		else if (sline.find("nss_cache") == 0)
+			config::nss_cache = 1024;
+		else if (sline.find("nss_contexts=") == 0)
+			config::nss_contexts = strtoul(sline.c_str() + 13, nullptr, 10);
+		else if (sline.find("passthrough") == 0)
+			config::passthrough = 1;
+		else if (sline.find("ktls") == 0)
+			config::ktls = 1;
+		else if (sline.find("select_policy=hash") == 0)
+			config::select_hash = 1;
 		else if (sline.find("internal_domain=") == 0) {
 			string::size_type comma = sline.find(",");
 			if (comma != string::npos && comma > 16)
 				config::internal_domains[sline.substr(16, comma - 16)] = sline.substr(comma + 1);
+		} else if (sline.find("warm_connections=") == 0) {
+			config::warm_connections = strtoul(sline.c_str() + 17, nullptr, 10);
+		} else if (sline.find("keepalive=") == 0) {
+			config::keepalive = strtoul(sline.c_str() + 10, nullptr, 10);
+			if (config::keepalive < 1)
+				config::keepalive = 1;
+		} else if (sline.find("max_inflight=") == 0) {
+			config::max_inflight = strtoul(sline.c_str() + 13, nullptr, 10);
+		} else if (sline.find("tls_session_dir=") == 0) {
+			config::tls_session_dir = sline.substr(16);
+		} else if (sline.find("nss_socket=") == 0) {
+			config::nss_socket = sline.substr(11);
+		} else if (sline.find("shm_cache=") == 0) {
+			config::shm_cache = sline.substr(10);
 		} else if (sline.find("rfc8484") == 0) {
 			config::ns_cfg->find(ns)->second.rfc8484 = 1;
+		} else if (sline.find("post") == 0) {
+			config::ns_cfg->find(ns)->second.post = 1;
+		} else if (sline.find("shadow_rate=") == 0) {
+			config::shadow_rate = strtoul(sline.c_str() + 12, nullptr, 10);
+			if (config::shadow_rate > 100)
+				config::shadow_rate = 100;
+		} else if (sline.find("shadow") == 0) {
+			// not used for answering, just compared against
+			auto &cfg = config::ns_cfg->find(ns)->second;
+			if (!cfg.shadow) {
+				cfg.shadow = 1;
+				config::ns->remove(ns);
+				config::shadow_ns.push_back(ns);
+			}
+		} else if (sline.find("dot") == 0) {
+			auto &cfg = config::ns_cfg->find(ns)->second;
+			cfg.dot = 1;
+			// rfc7858 default port, unless already set otherwise
+			if (cfg.port == 443)
+				cfg.port = 853;
+		} else if (sline.find("transport=http") == 0) {
+			auto &cfg = config::ns_cfg->find(ns)->second;
+			cfg.plain = 1;
+			if (cfg.port == 443)
+				cfg.port = 80;
+		} else if (sline.find("transport=unix:") == 0) {
+			auto &cfg = config::ns_cfg->find(ns)->second;
+			cfg.plain = 1;
+			cfg.unix_path = sline.substr(15);
 		} else if (sline.find("nameserver=") == 0) {
 			ns = sline.substr(11);
 			config::ns->push_back(ns);
-			config::ns_cfg->insert(make_pair(ns, a_ns_cfg{ns, "no-cn", "no-host", "no-get", 443, 0}));
+			config::ns_cfg->insert(make_pair(ns, a_ns_cfg{ns, "no-cn", "no-host", "no-get", 443, 0, 0, 0, 0, 0, ""}));
 		} else if (sline.find("cn=") == 0) {
 			config::ns_cfg->find(ns)->second.cn = sline.substr(3);
 		} else if (sline.find("host=") == 0) {
@@ -37,14 +37,43 @@ namespace config {
 
 
 extern std::list<std::string> *ns;
-extern bool log_requests, nss_aaaa, cache_PTR;
+
+// harddnsd: nameservers that only get copies of sampled queries, and the percentage
+extern std::list<std::string> shadow_ns;
+extern unsigned int shadow_rate;
+extern bool log_requests, nss_aaaa, nss_addrconfig, cache_PTR, passthrough, ktls, select_hash;
 
 extern std::map<std::string, std::string> internal_domains;
 
+extern std::string tls_session_dir;
+
+// Unix datagram socket of harddnsd, which NSS modules ask before doing DoH themselves
+extern std::string nss_socket;
+
+// harddnsd publishes its A/AAAA answers in this file, for all NSS modules to map
+extern std::string shm_cache;
+
+// harddnsd: number of upstream connections kept open, and seconds of idleness after
+// which they are probed so the server doesn't time them out
+extern unsigned int warm_connections, keepalive;
+
+// upper bound of the adaptive in-flight limit per nameserver
+extern unsigned int max_inflight;
+
+// NSS: number of answers each process caches, 0 to not cache
+extern unsigned int nss_cache;
+
+// NSS: number of lookups a process may have in flight at once, each with its own connection
+extern unsigned int nss_contexts;
+
 struct a_ns_cfg {
 	std::string ip, cn, host, get;
 	uint16_t port;
-	bool rfc8484;
+	bool rfc8484, post, dot, shadow;
+
+	// no TLS, for a co-located terminator; via AF_UNIX if unix_path is set
+	bool plain;
+	std::string unix_path;
 };
 
 extern std::map<std::string, struct a_ns_cfg> *ns_cfg;
@@ -87,6 +116,26 @@ enum { EARLY_DATA_ACCEPTED = 0 };
 
 #endif
 
+// Same for kernel TLS offload, which is only known to OpenSSL >= 3.0. OpenSSL silently
+// stays in userspace if the kernel lacks the tls module or the cipher is not supported.
+#ifdef SSL_OP_ENABLE_KTLS
+constexpr bool HAVE_KTLS = 1;
+
+enum : uint64_t { KTLS_OP = SSL_OP_ENABLE_KTLS };
+
+#else
+constexpr bool HAVE_KTLS = 0;
+
+#ifndef BIO_get_ktls_send
+int BIO_get_ktls_send(const void *);
+
+int BIO_get_ktls_recv(const void *);
+#endif
+
+enum : uint64_t { KTLS_OP = 0 };
+
+#endif
+
 }
 
 #endif
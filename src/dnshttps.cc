@@ -19,18 +19,32 @@
  */
 
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <iterator>
+#include <thread>
+#include <chrono>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <cstring>
 #include <syslog.h>
 #include "misc.h"
 #include "dnshttps.h"
+#include "dnsmsg.h"
+#include "json.h"
+#include "aimd.h"
 #include "net-headers.h"
 #include "base64.h"
 #include "config.h"
@@ -45,13 +59,40 @@ using namespace net_headers;
 dnshttps *dns = nullptr;
 
 
-// construct a DNS query for rfc8484
-string make_query(const string &name, uint16_t qtype)
+dnshttps::~dnshttps()
+{
+	if (d_warm_thread.joinable()) {
+		{
+			lock_guard<mutex> g(d_warm_mtx);
+			d_warm_stop = 1;
+		}
+		d_warm_cv.notify_all();
+		d_warm_thread.join();
+	}
+
+	// don't delete the ssl we were given, but the ones we created,
+	// wherever they are after swapping
+	for (auto &w : d_warm) {
+		if (w.box != d_orig)
+			delete w.box;
+	}
+	if (ssl != d_orig)
+		delete ssl;
+}
+
+
+static uint16_t query_id()
 {
 	timeval tv = {0, 0};
 	gettimeofday(&tv, nullptr);
+	return tv.tv_usec % 0xffff;
+}
+
 
-	string dns_query = "", qname = "", b64query = "";
+// construct a DNS query for rfc8484
+string make_query(const string &name, uint16_t qtype)
+{
+	string dns_query = "", qname = "";
 
 	uint16_t qclass = htons(1);
 
@@ -60,11 +101,15 @@ string make_query(const string &name, uint16_t qtype)
 	qhdr.q_count = htons(1);
 	qhdr.qr = 0;
 	qhdr.rd = 1;
-	qhdr.id = tv.tv_usec % 0xffff;
+	qhdr.id = query_id();
 
-	host2qname(name, qname);
+	// root, for probes
+	if (name == ".")
+		qname = string(1, 0);
+	else
+		host2qname(name, qname);
 	if (!qname.size())
-		return b64query;
+		return dns_query;
 
 	dns_query = string(reinterpret_cast<char *>(&qhdr), sizeof(qhdr));
 	//https://www.rfc-editor.org/rfc/rfc1035#section-4.1.2
@@ -72,8 +117,400 @@ string make_query(const string &name, uint16_t qtype)
 	dns_query += string(reinterpret_cast<char *>(&qtype), sizeof(uint16_t));
 	dns_query += string(reinterpret_cast<char *>(&qclass), sizeof(uint16_t));
 
-	b64url_encode(dns_query, b64query);
-	return b64query;
+	return dns_query;
+}
+
+
+// EDNS(0) padding (rfc7830) of a wire query to a multiple of the rfc8467 recommended
+// block size. If the query already has an OPT RR as its last record, the padding option
+// is appended to it. Otherwise an OPT RR is added if add_opt is set.
+void pad_query(string &query, bool add_opt)
+{
+	const size_t block = 128;
+
+	dns_msg msg(query);
+	string::size_type qname = 0, idx = string::npos, opt = string::npos;
+	uint16_t qtype = 0, qclass = 0;
+
+	if ((idx = msg.question(qname, qtype, qclass)) == string::npos)
+		return;
+
+	unsigned int nrrs = msg.an_count() + msg.ns_count() + msg.ar_count();
+	dns_msg::rr_t rr;
+
+	for (unsigned int i = 0; i < nrrs; ++i) {
+		if ((idx = msg.next_rr(idx, rr)) == string::npos)
+			return;
+		opt = rr.qtype == htons(dns_type::OPT) ? rr.rdata : string::npos;
+	}
+
+	// trailing garbage or OPT not at the end
+	if (idx != query.size())
+		return;
+
+	if (opt == string::npos) {
+		if (!add_opt || msg.ar_count() == 0xffff)
+			return;
+
+		uint16_t ar = htons(msg.ar_count() + 1);
+		memcpy(&query[10], &ar, sizeof(ar));
+
+		// root name, OPT, 1232 byte UDP payload, no ext. rcode/flags, empty rdata
+		uint16_t type = htons(dns_type::OPT), udp = htons(1232), rdlen = 0;
+		uint32_t ttl = 0;
+		query += '\0';
+		query += string(reinterpret_cast<char *>(&type), sizeof(type));
+		query += string(reinterpret_cast<char *>(&udp), sizeof(udp));
+		query += string(reinterpret_cast<char *>(&ttl), sizeof(ttl));
+		query += string(reinterpret_cast<char *>(&rdlen), sizeof(rdlen));
+		opt = query.size();
+	}
+
+	// padding option: 16bit code 12, 16bit length, zeros
+	size_t plen = (block - (query.size() + 2*sizeof(uint16_t)) % block) % block;
+	uint16_t rdlen = 0, code = htons(12), olen = htons(plen);
+
+	memcpy(&rdlen, &query[opt - sizeof(uint16_t)], sizeof(rdlen));
+	rdlen = htons(ntohs(rdlen) + 2*sizeof(uint16_t) + plen);
+	memcpy(&query[opt - sizeof(uint16_t)], &rdlen, sizeof(rdlen));
+
+	query += string(reinterpret_cast<char *>(&code), sizeof(code));
+	query += string(reinterpret_cast<char *>(&olen), sizeof(olen));
+	query += string(plen, 0);
+}
+
+
+// Build the HTTP request for the nameserver described by cfg. For GET, arg is appended
+// to the configured GET path, i.e. the b64url encoded query or the name and type for dns-json.
+// For rfc8484 POST, arg is the binary query which is sent as body to the path without the
+// query string. POST requests are padded via EDNS(0) inside the DNS query rather than
+// via X-Igno header.
+static string make_request(const config::a_ns_cfg &cfg, const string &arg)
+{
+	string req = "";
+
+	if (cfg.rfc8484 && cfg.post)
+		req = "POST " + cfg.get.substr(0, cfg.get.find("?"));
+	else
+		req = "GET " + cfg.get + arg;
+
+	req += " HTTP/1.1\r\nHost: " + cfg.host + "\r\nUser-Agent: harddns 0.58 github.com/stealth/harddns\r\nConnection: Keep-Alive\r\n";
+
+	if (cfg.rfc8484)
+		req += "Accept: application/dns-message\r\n";
+	else
+		req += "Accept: application/dns-json\r\n";
+
+	if (cfg.rfc8484 && cfg.post) {
+		req += "Content-Type: application/dns-message\r\nContent-Length: " + to_string(arg.size()) + "\r\n\r\n";
+		req += arg;
+		return req;
+	}
+
+	if (req.size() < 450)
+		req += "X-Igno: " + string(450 - req.size(), 'X') + "\r\n";
+
+	req += "\r\n";
+
+	//printf(">>>> %s\n", req.c_str());
+	return req;
+}
+
+
+// An in-flight request to a nameserver, for its adaptive limit
+class inflight {
+
+	const string &d_ns;
+
+	timeval d_start{0, 0};
+
+public:
+
+	bool ok{0};
+
+	explicit inflight(const string &ns)
+		: d_ns(ns)
+	{
+		gettimeofday(&d_start, nullptr);
+	}
+
+	~inflight()
+	{
+		timeval now = {0, 0};
+		gettimeofday(&now, nullptr);
+		if (upstream_limits)
+			upstream_limits->release(d_ns, ok, (now.tv_sec - d_start.tv_sec)*1000000 + now.tv_usec - d_start.tv_usec);
+	}
+};
+
+
+// Take an in-flight slot of cfg, or tell to try another nameserver. After one round through
+// all nameservers, the limits are ignored, as the query has to go somewhere.
+static bool may_send(const config::a_ns_cfg &cfg, unsigned int i)
+{
+	return !upstream_limits || upstream_limits->acquire(cfg.ip, i >= config::ns->size());
+}
+
+
+static atomic<unsigned long> ns_rotation{0};
+
+
+// Answers are added to what a dns_reply already has, so that the NSS module can
+// collect a CNAME chain over several queries
+static unsigned int reply_end(const dnshttps::dns_reply &result)
+{
+	return result.size() > 0 ? result.rbegin()->first + 1 : 0;
+}
+
+
+// Pick the nameserver to ask next: the one we are still connected to, unless no_peer
+// is set, or the next in the rotation. If wire_only is set, dns-json only servers are not used.
+const config::a_ns_cfg *dnshttps::next_ns(bool wire_only, bool no_peer)
+{
+	string ns = ssl->peer();
+
+	if (ns.size() > 0 && !no_peer) {
+		auto cfg = config::ns_cfg->find(ns);
+		if (cfg != config::ns_cfg->end() && (!wire_only || cfg->second.rfc8484 || cfg->second.dot))
+			return &cfg->second;
+	}
+
+	// cycle through list of DNS servers; shared by all instances, which may
+	// run in parallel, so the list itself is left alone
+	auto it = config::ns->begin();
+	advance(it, ns_rotation++ % config::ns->size());
+	ns = *it;
+
+	auto cfg = config::ns_cfg->find(ns);
+	if (cfg == config::ns_cfg->end() || (wire_only && !cfg->second.rfc8484 && !cfg->second.dot))
+		return nullptr;
+
+	//printf(">>>> %s %s %s %s\n", cfg->second.ip.c_str(), cfg->second.get.c_str(), cfg->second.host.c_str(), cfg->second.cn.c_str());
+
+	return &cfg->second;
+}
+
+
+// Find a nameserver of the same provider as cfg, that is reached the same way but
+// via the other address family, to race against it.
+static const config::a_ns_cfg *race_peer(const config::a_ns_cfg &cfg)
+{
+	bool v6 = cfg.ip.find(":") != string::npos;
+
+	// local terminators have nobody to race against
+	if (cfg.plain)
+		return nullptr;
+
+	for (auto &c : *config::ns_cfg) {
+		const config::a_ns_cfg &alt = c.second;
+		if (alt.shadow || (alt.ip.find(":") != string::npos) == v6)
+			continue;
+		if (alt.cn == cfg.cn && alt.host == cfg.host && alt.get == cfg.get && alt.port == cfg.port &&
+		    alt.rfc8484 == cfg.rfc8484 && alt.post == cfg.post && alt.dot == cfg.dot)
+			return &alt;
+	}
+
+	return nullptr;
+}
+
+
+// Send req to the nameserver of cfg, (re-)connecting if necessary.
+// Returns -1 if this nameserver failed and the connection was closed.
+int dnshttps::send_request(const config::a_ns_cfg &cfg, string &req)
+{
+	const string &ns = cfg.ip;
+
+	// connected elsewhere, as nameservers may be picked by name
+	if (ssl->peer() != ns) {
+		take_warm(ns, 0);
+		if (ssl->peer() != ns)
+			ssl->close();
+	}
+
+	// maybe closed due to error or not initialized in the first place
+	if (ssl->send(req) <= 0) {
+		const config::a_ns_cfg *alt = race_peer(cfg);
+
+		if ((alt ? ssl->connect_race(ns, alt->ip, cfg.port, req) : ssl->connect(ns, cfg.port, req)) < 0) {
+			ssl->close();
+			syslog(LOG_INFO, "No %s connection to %s (%s)", cfg.plain ? "plain" : "SSL", ns.c_str(), ssl->why());
+			return -1;
+		}
+		if (req.size() && ssl->send(req) != (int)req.size()) {
+			ssl->close();
+			syslog(LOG_INFO, "Unable to complete request to %s.", ns.c_str());
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+// rfc8767 Sec. 4 recommended cap of TTLs
+enum : unsigned long { max_cache_age = 86400 };
+
+
+// rfc9111 Sec. 4.2: the remaining freshness of an HTTP reply is its Cache-Control max-age
+// minus its Age, clamped to [1, max_cache_age]. no-cache, no-store and max-age=0 yield 0.
+// Returns false if there is no such header, in which case max_age is unchanged.
+static bool http_max_age(const string &reply, uint32_t &max_age)
+{
+	string::size_type idx = reply.find("\r\n\r\n"), eol = string::npos;
+	if (idx == string::npos)
+		return 0;
+
+	// header names are case insensitive
+	string hdr = lcs(reply.substr(0, idx + 2));
+
+	if ((idx = hdr.find("\r\ncache-control:")) == string::npos || (eol = hdr.find("\r\n", idx + 2)) == string::npos)
+		return 0;
+	string cc = hdr.substr(idx + 16, eol - idx - 16);
+
+	if (cc.find("no-cache") != string::npos || cc.find("no-store") != string::npos) {
+		max_age = 0;
+		return 1;
+	}
+
+	if ((idx = cc.find("max-age=")) == string::npos)
+		return 0;
+	unsigned long secs = strtoul(cc.c_str() + idx + 8, nullptr, 10), age = 0;
+	if (secs == 0) {
+		max_age = 0;
+		return 1;
+	}
+
+	if ((idx = hdr.find("\r\nage:")) != string::npos)
+		age = strtoul(hdr.c_str() + idx + 6, nullptr, 10);
+
+	secs = secs > age ? secs - age : 1;
+	max_age = secs > max_cache_age ? max_cache_age : secs;
+	return 1;
+}
+
+
+// Send req to the nameserver of cfg and read the reply.
+// Returns 0 with the HTTP body in body, which points into reply or chunked, or -1 if
+// this nameserver failed, in which case the connection has already been closed.
+int dnshttps::transact(const config::a_ns_cfg &cfg, string &req, string &reply, string_view &body, string &chunked)
+{
+	const string &ns = cfg.ip;
+	string tmp = "";
+
+	reply = "";
+
+	if (send_request(cfg, req) < 0)
+		return -1;
+
+	string::size_type idx = string::npos, content_idx = string::npos;
+	size_t cl = 0;
+	const int maxtries = 3;
+	bool has_answer = 0;
+
+	for (int j = 0; j < maxtries; ++j) {
+		if (ssl->recv(tmp) <= 0) {
+			ssl->close();
+			syslog(LOG_INFO, "Error when receiving reply from %s (%s)", ns.c_str(), ssl->why());
+			return -1;
+		}
+		reply += tmp;
+
+		if (reply.find("HTTP/1.1 200 OK") == string::npos) {
+			ssl->close();
+			syslog(LOG_INFO, "Error response from %s.", ns.c_str());
+			return -1;
+		}
+
+		if (reply.find("Transfer-Encoding: chunked\r\n") != string::npos && reply.find("\r\n0\r\n\r\n") != string::npos) {
+			has_answer = 1;
+			break;
+		}
+
+		if (cl == 0 && (idx = reply.find("Content-Length:")) != string::npos) {
+			idx += 15;
+			if (idx >= reply.size())
+				continue;
+
+			cl = strtoul(reply.c_str() + idx, nullptr, 10);
+			if (cl > 65535) {
+				ssl->close();
+				syslog(LOG_INFO, "Insanely large reply from %s", ns.c_str());
+				return -1;
+			}
+		}
+
+		if (cl > 0 && (content_idx = reply.find("\r\n\r\n")) != string::npos) {
+			content_idx += 4;
+			if (content_idx <= reply.size() && reply.size() - content_idx < cl)
+				continue;
+
+			has_answer = 1;
+			break;
+		}
+	}
+
+	if (!has_answer || http_body(reply, content_idx, cl, body, chunked) < 0) {
+		ssl->close();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// DNS-over-TLS (rfc7858): 16bit length prefixed DNS messages on the TLS stream.
+// The answer is matched by the ID of the query. Stale answers to earlier queries that
+// timed out are skipped, data of following answers is kept for the next read.
+int dnshttps::transact_dot(const config::a_ns_cfg &cfg, const string &query, string &answer)
+{
+	const string &ns = cfg.ip;
+	uint16_t len = htons(query.size());
+	string req = "", buf = "", tmp = "";
+
+	answer = "";
+
+	if (query.size() < sizeof(dnshdr) || query.size() > 0xffff)
+		return build_error("Invalid DoT query.", -1);
+
+	req = string(reinterpret_cast<char *>(&len), sizeof(len)) + query;
+
+	if (send_request(cfg, req) < 0)
+		return -1;
+
+	const int maxtries = 3;
+
+	for (int j = 0; j < maxtries;) {
+		if (buf.size() >= sizeof(len)) {
+			memcpy(&len, buf.c_str(), sizeof(len));
+			len = ntohs(len);
+			if (buf.size() >= sizeof(len) + len) {
+				answer = buf.substr(sizeof(len), len);
+				buf.erase(0, sizeof(len) + len);
+
+				if (answer.size() >= sizeof(dnshdr) && memcmp(answer.c_str(), query.c_str(), sizeof(uint16_t)) == 0) {
+					if (buf.size())
+						ssl->unread(buf);
+					return 0;
+				}
+
+				if (config::log_requests)
+					syslog(LOG_INFO, "Skipping stale DoT answer from %s", ns.c_str());
+				continue;
+			}
+		}
+
+		if (ssl->recv(tmp) <= 0) {
+			ssl->close();
+			syslog(LOG_INFO, "Error when receiving reply from %s (%s)", ns.c_str(), ssl->why());
+			return -1;
+		}
+		buf += tmp;
+		++j;
+	}
+
+	ssl->close();
+	syslog(LOG_INFO, "Incomplete DoT reply from %s", ns.c_str());
+	return -1;
 }
 
 
@@ -82,11 +519,12 @@ string make_query(const string &name, uint16_t qtype)
 // https://www.quad9.net/doh-quad9-dns-servers
 // https://tools.ietf.org/html/rfc8484
 
-int dnshttps::get(const string &name, uint16_t qtype, dns_reply &result, string &raw)
+int dnshttps::get(const string &name, uint16_t qtype, dns_reply &result, string &raw, uint32_t &max_age)
 {
 	// don't:
 	//result.clear();
 	raw = "";
+	max_age = no_max_age;
 
 	if (!ssl || !config::ns)
 		return build_error("Not properly initialized.", -1);
@@ -94,551 +532,1004 @@ int dnshttps::get(const string &name, uint16_t qtype, dns_reply &result, string
 	if (!valid_name(name))
 		return build_error("Invalid FQDN", -1);
 
-	for (unsigned int i = 0; i < config::ns->size(); ++i) {
+	// rather notice a connection that the server closed meanwhile now, than by a failed request
+	if (ssl->peer().size() && !ssl->alive())
+		ssl->close();
+	if (ssl->peer().empty())
+		take_warm("", 0);
 
-		string ns = ssl->peer();
+	vector<const config::a_ns_cfg *> order;
+	if (config::select_hash)
+		hash_order(name, 0, order);
 
-		if (ns.size() == 0) {
-			ns = config::ns->front();
+	bool spilled = 0;
+	unsigned int first = reply_end(result);
 
-			// cycle through list of DNS servers
-			config::ns->push_back(ns);
-			config::ns->pop_front();
-		}
+	for (unsigned int i = 0, n = config::ns->size(); i < n; ++i) {
 
-		const auto &cfg = config::ns_cfg->find(ns);
-		if (cfg == config::ns_cfg->end())
+		const config::a_ns_cfg *cfg = config::select_hash ? (i < order.size() ? order[i] : nullptr) : next_ns(0, spilled);
+		if (!cfg)
 			continue;
-		const string &get = cfg->second.get;
-		const string &host = cfg->second.host;
-
-		//printf(">>>> %s %s %s %s\n", cfg->second.ip.c_str(), cfg->second.get.c_str(), cfg->second.host.c_str(), cfg->second.cn.c_str());
 
-		string req = "GET " + get, reply = "", tmp = "";
-
-		if (cfg->second.rfc8484) {
-			string b64 = make_query(name, qtype);
-			if (!b64.size())
+		// at its limit: spill over to the others, and come back later if need be
+		if (!may_send(*cfg, i)) {
+			if (config::select_hash)
+				order.push_back(cfg);
+			spilled = 1;
+			++n;
+			continue;
+		}
+		inflight flight(cfg->ip);
+
+		string arg = "", reply = "", chunked = "";
+		string_view body;
+
+		if (cfg->dot) {
+			string query = make_query(name, qtype);
+			if (!query.size())
+				return build_error("Failed to create DoT request.", -1);
+			pad_query(query, 1);
+			if (transact_dot(*cfg, query, reply) < 0) {
+				mark_down(*cfg);
+				continue;
+			}
+			body = reply;
+		} else if (cfg->rfc8484) {
+			string query = make_query(name, qtype);
+			if (!query.size())
 				return build_error("Failed to create rfc8484 request.", -1);
-			req += b64;
+			if (cfg->post) {
+				pad_query(query, 1);
+				arg = query;
+			} else
+				b64url_encode(query, arg);
 		} else {
-			req += name;
+			arg = name;
 			// qtype值 https://www.rfc-editor.org/rfc/rfc1035#section-3.2.3
 			// https://www.rfc-editor.org/rfc/rfc1035#section-3.2.2
 			if (qtype == htons(dns_type::A))
-				req += "&type=A";
+				arg += "&type=A";
 			//ip6扩展 https://www.rfc-editor.org/rfc/rfc3596
 			else if (qtype == htons(dns_type::AAAA))
-				req += "&type=AAAA";
+				arg += "&type=AAAA";
 			else if (qtype == htons(dns_type::NS))
-				req += "&type=NS";
+				arg += "&type=NS";
+			else if (qtype == htons(dns_type::PTR))
+				arg += "&type=PTR";
 			else if (qtype == htons(dns_type::MX))
-				req += "&type=MX";
+				arg += "&type=MX";
 			else
 				return build_error("Can't handle query type.", -1);
 		}
 
-		req += " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: harddns 0.58 github.com/stealth/harddns\r\nConnection: Keep-Alive\r\n";
+		if (!cfg->dot) {
+			string req = make_request(*cfg, arg);
 
-		if (cfg->second.rfc8484)
-			req += "Accept: application/dns-message\r\n";
+			if (transact(*cfg, req, reply, body, chunked) < 0) {
+				mark_down(*cfg);
+				continue;
+			}
+		}
+
+		int r = 0;
+		if (cfg->rfc8484 || cfg->dot)
+			r = parse_rfc8484(name, qtype, result, raw, body);
 		else
-			req += "Accept: application/dns-json\r\n";
+			r = parse_json(name, qtype, result, raw, body);
+
+		if (r >= 0) {
+			d_down.erase(cfg->ip);
+			flight.ok = 1;
+			if (!cfg->dot)
+				http_max_age(reply, max_age);
+
+			// the nameserver is fine, but could not tell: SERVFAIL, REFUSED etc.
+			if (d_rcode != 0 && d_rcode != 3)
+				return build_error("DNS error response " + to_string(d_rcode) + " from " + cfg->ip + ".", -1);
+			return r;
+		}
 
+		syslog(LOG_INFO, "Error when parsing reply from %s for %s: %s", cfg->ip.c_str(), name.c_str(), this->why());
+		result.erase(result.lower_bound(first), result.end());
+		ssl->close();
+		mark_down(*cfg);
+	}
 
-		if (req.size() < 450)
-			req += "X-Igno: " + string(450 - req.size(), 'X');
+	return build_error("No nameserver answered.", -1);
+}
 
-		req += "\r\n\r\n";
 
-		//printf(">>>> %s\n", req.c_str());
+// Forward the wire query as is to a rfc8484 or DoT nameserver and return the wire answer.
+// The ID is set to 0 on the wire (rfc8484 Sec. 4.1), or to a fresh one for DoT where
+// it is used to match answers, and restored in the answer.
+// The answer is only checked to be a well-formed reply to the query, and the
+// smallest TTL of all of its records is returned in min_ttl for caching.
+int dnshttps::get_wire(const string &query, string &answer, uint32_t &min_ttl)
+{
+	answer = "";
+	min_ttl = 0;
 
-		// maybe closed due to error or not initialized in the first place
-		if (ssl->send(req) <= 0) {
-			if (ssl->connect(ns, cfg->second.port, req) < 0) {
-				ssl->close();
-				syslog(LOG_INFO, "No SSL connection to %s (%s)", ns.c_str(), ssl->why());
-				continue;
-			}
-			if (req.size() && ssl->send(req) != (int)req.size()) {
-				ssl->close();
-				syslog(LOG_INFO, "Unable to complete request to %s.", ns.c_str());
-				continue;
-			}
+	if (!ssl || !config::ns)
+		return build_error("Not properly initialized.", -1);
+
+	dns_msg qmsg(query);
+	string::size_type qname = 0, qend = string::npos;
+	uint16_t qtype = 0, qclass = 0;
+
+	if ((qend = qmsg.question(qname, qtype, qclass)) == string::npos)
+		return build_error("Invalid query.", -1);
+
+	if (ssl->peer().size() && !ssl->alive())
+		ssl->close();
+	if (ssl->peer().empty())
+		take_warm("", 1);
+
+	string id0_query = query, b64 = "";
+	memset(&id0_query[0], 0, sizeof(uint16_t));
+	b64url_encode(id0_query, b64);
+
+	// POST and DoT: no need to encode, but pad if the client speaks EDNS(0)
+	pad_query(id0_query, 0);
+
+	string_view question(query.c_str() + sizeof(dnshdr), qend - sizeof(dnshdr));
+
+	vector<const config::a_ns_cfg *> order;
+	if (config::select_hash) {
+		string host = "";
+		qmsg.expand_host(qname, host, 1);
+		if (host.size() > 1)
+			host.pop_back();
+		hash_order(host, 1, order);
+	}
+
+	bool spilled = 0;
+
+	for (unsigned int i = 0, n = config::ns->size(); i < n; ++i) {
+
+		const config::a_ns_cfg *cfg = config::select_hash ? (i < order.size() ? order[i] : nullptr) : next_ns(1, spilled);
+		if (!cfg)
+			continue;
+
+		// at its limit: spill over to the others, and come back later if need be
+		if (!may_send(*cfg, i)) {
+			if (config::select_hash)
+				order.push_back(cfg);
+			spilled = 1;
+			++n;
+			continue;
 		}
+		inflight flight(cfg->ip);
 
-		string::size_type idx = string::npos, content_idx = string::npos;
-		size_t cl = 0;
-		const int maxtries = 3;
-		bool has_answer = 0;
+		if (ask_wire(*cfg, id0_query, b64, question, answer, min_ttl) < 0) {
+			mark_down(*cfg);
+			continue;
+		}
 
-		for (int j = 0; j < maxtries; ++j) {
-			if (ssl->recv(tmp) <= 0) {
-				ssl->close();
-				syslog(LOG_INFO, "Error when receiving reply from %s (%s)", ns.c_str(), ssl->why());
-				break;
-			}
-			reply += tmp;
+		d_down.erase(cfg->ip);
+		flight.ok = 1;
+		memcpy(&answer[0], query.c_str(), sizeof(uint16_t));
+		return 1;
+	}
 
-			if (reply.find("HTTP/1.1 200 OK") == string::npos) {
-				ssl->close();
-				syslog(LOG_INFO, "Error response from %s.", ns.c_str());
-				break;
-			}
+	return build_error("No rfc8484 or DoT nameserver answered.", -1);
+}
 
-			if (reply.find("Transfer-Encoding: chunked\r\n") != string::npos && reply.find("\r\n0\r\n\r\n") != string::npos) {
-				has_answer = 1;
-				break;
-			}
 
-			if (cl == 0 && (idx = reply.find("Content-Length:")) != string::npos) {
-				idx += 15;
-				if (idx >= reply.size())
-					continue;
+// FNV-1a
+static uint64_t fnv1a(const string &s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (auto c : s) {
+		h ^= static_cast<unsigned char>(c);
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
 
-				cl = strtoul(reply.c_str() + idx, nullptr, 10);
-				if (cl > 65535) {
-					ssl->close();
-					syslog(LOG_INFO, "Insanely large reply from %s", ns.c_str());
-					break;
-				}
-			}
 
-			if (cl > 0 && (content_idx = reply.find("\r\n\r\n")) != string::npos) {
-				content_idx += 4;
-				if (content_idx <= reply.size() && reply.size() - content_idx < cl)
-					continue;
+// splitmix64 finalizer, so that names differing in a single bit
+// rank the groups independently
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
 
-				has_answer = 1;
-				break;
-			}
+
+// skip a failed nameserver for a while
+enum { down_secs = 30 };
+
+
+void dnshttps::mark_down(const config::a_ns_cfg &cfg)
+{
+	d_down[cfg.ip] = time(nullptr) + down_secs;
+}
+
+
+// Rendezvous hashing of the (lowercased) name onto the provider groups, so that the
+// same name keeps going to the same provider and hits its cache. Returns all usable
+// nameservers ordered by the rank of their group, the one we are connected to first
+// within a group. Nameservers that failed recently go last, as a fallback.
+void dnshttps::hash_order(const string &name, bool wire_only, vector<const config::a_ns_cfg *> &order)
+{
+	// same provider and reached the same way
+	if (d_groups.empty()) {
+		for (auto &c : *config::ns_cfg) {
+			const config::a_ns_cfg &cfg = c.second;
+			if (cfg.shadow)
+				continue;
+			uint64_t h = fnv1a(cfg.cn + "/" + cfg.host + cfg.get + "#" + to_string(cfg.port) +
+			                   (cfg.rfc8484 ? "r" : "") + (cfg.post ? "p" : "") + (cfg.dot ? "d" : ""));
+			auto g = find_if(d_groups.begin(), d_groups.end(), [h](const group_t &x) { return x.hash == h; });
+			if (g == d_groups.end())
+				d_groups.push_back({h, {&cfg}});
+			else
+				g->ns.push_back(&cfg);
 		}
+	}
 
-		if (!has_answer)
-			ssl->close();
-		else {
-			int r = 0;
-			if (cfg->second.rfc8484)
-				r = parse_rfc8484(name, qtype, result, raw, reply, content_idx, cl);
+	uint64_t h = fnv1a(lcs(name));
+	vector<pair<uint64_t, const group_t *>> ranked;
+	for (auto &g : d_groups)
+		ranked.push_back({mix(h ^ g.hash), &g});
+	sort(ranked.begin(), ranked.end(), [](const pair<uint64_t, const group_t *> &a, const pair<uint64_t, const group_t *> &b) { return a.first > b.first; });
+
+	vector<const config::a_ns_cfg *> down;
+	time_t now = time(nullptr);
+	string peer = ssl->peer();
+
+	order.clear();
+	for (auto &r : ranked) {
+		auto first = order.size();
+		for (auto cfg : r.second->ns) {
+			if (wire_only && !cfg->rfc8484 && !cfg->dot)
+				continue;
+			auto it = d_down.find(cfg->ip);
+			if (it != d_down.end() && it->second > now)
+				down.push_back(cfg);
+			else if (cfg->ip == peer)
+				order.insert(order.begin() + first, cfg);
 			else
-				r = parse_json(name, qtype, result, raw, reply, content_idx, cl);
+				order.push_back(cfg);
+		}
+	}
+	order.insert(order.end(), down.begin(), down.end());
+}
 
-			if (r >= 0)
-				return r;
 
-			syslog(LOG_INFO, "Error when parsing reply from %s for %s: %s", ns.c_str(), name.c_str(), this->why());
-			ssl->close();
+// Swap in a warm connection to ns, or to any nameserver if ns is empty. The connection
+// that was in use takes its place and is reconnected to the slot's nameserver by the worker.
+void dnshttps::take_warm(const string &ns, bool wire_only, bool fresh)
+{
+	if (d_warm.empty())
+		return;
+
+	lock_guard<mutex> g(d_warm_mtx);
+
+	for (auto &w : d_warm) {
+		if (w.busy || w.box->peer().empty() || (fresh && w.box->idle() >= (time_t)config::keepalive))
+			continue;
+		if (ns.size() ? w.box->peer() != ns : (wire_only && !w.cfg->rfc8484 && !w.cfg->dot))
 			continue;
+
+		swap(ssl, w.box);
+		if (config::log_requests)
+			syslog(LOG_INFO, "Using warm connection to %s", ssl->peer().c_str());
+
+		// Rather than closing the connection we give away, let the slot keep it
+		// warm, unless its nameserver already has a slot. Matters if queries go to
+		// changing nameservers, as with select_policy = hash.
+		auto cfg = config::ns_cfg->find(w.box->peer());
+		if (cfg != config::ns_cfg->end() &&
+		    none_of(d_warm.begin(), d_warm.end(), [&cfg](const warm_t &x) { return x.cfg == &cfg->second; }))
+			w.cfg = &cfg->second;
+		return;
+	}
+}
+
+
+// Cheap query for the root NS, so that idle connections are not timed out by the server
+int dnshttps::probe(const config::a_ns_cfg &cfg)
+{
+	string query = make_query(".", htons(dns_type::NS)), arg = "", req = "", reply = "", chunked = "";
+	string_view body;
+
+	if (cfg.dot) {
+		pad_query(query, 1);
+		return transact_dot(cfg, query, reply);
+	}
+
+	if (cfg.rfc8484) {
+		if (cfg.post) {
+			pad_query(query, 1);
+			arg = query;
+		} else
+			b64url_encode(query, arg);
+	} else
+		arg = ".&type=NS";
+
+	req = make_request(cfg, arg);
+	return transact(cfg, req, reply, body, chunked);
+}
+
+
+// harddnsd: set up config::warm_connections connections to the first nameservers.
+// Must be called before chroot, as it loads the CA certs. They are connected once
+// maintain() is called.
+int dnshttps::init_warm()
+{
+	if (!ssl || !config::ns)
+		return build_error("Not properly initialized.", -1);
+
+	for (auto &ns : *config::ns) {
+		if (d_warm.size() >= config::warm_connections)
+			break;
+
+		auto cfg = config::ns_cfg->find(ns);
+		if (cfg == config::ns_cfg->end() || (config::passthrough && !cfg->second.rfc8484 && !cfg->second.dot))
+			continue;
+
+		ssl_box *box = new (nothrow) ssl_box(d_orig->sessions());
+		if (!box)
+			return build_error("init_warm: OOM", -1);
+		if (box->setup_ctx() < 0) {
+			string e = box->why();
+			delete box;
+			return build_error("init_warm:" + e, -1);
 		}
+		box->share_pinned(*d_orig);
+		d_warm.push_back({box, &cfg->second, 0, 0});
 	}
 
 	return 0;
 }
 
 
-int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result, string &raw, const string &reply, string::size_type content_idx, size_t cl)
+// harddnsd: called from the proxy loop. Starts the worker on the first call and,
+// at most once a second, drops the connection in use if it is dead. Nothing here may
+// block: an idle connection is swapped for a warm one and probed by the worker.
+void dnshttps::maintain()
 {
-	string dns_reply = "", tmp = "";
-	string::size_type idx = string::npos, aidx = string::npos;
-	bool has_answer = 0;
-	unsigned int acnt = 0;
+	if (d_warm.empty())
+		return;
+
+	if (!d_warm_thread.joinable())
+		d_warm_thread = thread(&dnshttps::warm_worker, this);
+
+	time_t now = time(nullptr);
+	if (now == d_last_maintain)
+		return;
+	d_last_maintain = now;
+
+	string ns = ssl->peer();
+	if (ns.empty())
+		return;
+
+	auto cfg = config::ns_cfg->find(ns);
+	if (!ssl->alive() || cfg == config::ns_cfg->end())
+		ssl->close();
+	else if (ssl->idle() >= (time_t)config::keepalive) {
+		// preferably to the same nameserver, so that its slot keeps the idle one
+		take_warm(ns, 0, 1);
+		if (ssl->idle() >= (time_t)config::keepalive)
+			take_warm("", config::passthrough, 1);
+		d_warm_cv.notify_one();
+	}
+}
 
-	if (cl > 0 && content_idx != string::npos) {
-		dns_reply = reply.substr(content_idx);
-		if (dns_reply.size() < cl)
-			return build_error("Incomplete read from rfc8484 server.", -1);
-	} else {
-		// parse chunked encoding
-		idx = reply.find("\r\n\r\n");
-		if (idx == string::npos || idx + 4 >= reply.size())
-			return build_error("Invalid reply (1).", -1);
-		idx += 4;
-		for (;;) {
-			string::size_type nl = reply.find("\r\n", idx);
-			if (nl == string::npos || nl + 2 > reply.size())
-				return build_error("Invalid reply (2).", -1);
-			cl = strtoul(reply.c_str() + idx, nullptr, 16);
-
-			// end of chunk?
-			if (cl == 0)
+
+// Connect the warm connections at startup and whenever they were closed,
+// and probe them before they idle out.
+void dnshttps::warm_worker()
+{
+	unique_lock<mutex> lck(d_warm_mtx);
+
+	while (!d_warm_stop) {
+		for (auto &w : d_warm) {
+			if (d_warm_stop)
 				break;
 
-			if (cl > 65535 || nl + 2 + cl + 2 > reply.size())
-				return build_error("Invalid reply (3).", -1);
-			idx = nl + 2;
-			dns_reply += reply.substr(idx, cl);
-			idx += cl + 2;
+			w.busy = 1;
+			ssl_box *box = w.box;
+			const config::a_ns_cfg *cfg = w.cfg;
+			time_t next_try = w.next_try, now = time(nullptr);
+			lck.unlock();
+
+			// closed, or left behind by a query that swapped it out
+			if (box->peer().size() && (box->peer() != cfg->ip || !box->alive())) {
+				if (config::log_requests && box->peer() == cfg->ip)
+					syslog(LOG_INFO, "Warm connection to %s closed by peer.", cfg->ip.c_str());
+				box->close();
+			}
+
+			if (box->peer().empty()) {
+				string early = "";
+				if (now < next_try)
+					;
+				else if (box->connect(cfg->ip, cfg->port, early) < 0) {
+					syslog(LOG_INFO, "No SSL connection to %s (%s)", cfg->ip.c_str(), box->why());
+					box->close();
+					next_try = now + config::keepalive;
+				} else if (config::log_requests)
+					syslog(LOG_INFO, "Warm connection to %s established.", cfg->ip.c_str());
+			} else if (box->idle() >= (time_t)config::keepalive) {
+				dnshttps prober(box);
+				if (prober.probe(*cfg) < 0)
+					syslog(LOG_INFO, "Keep-alive probe to %s failed: %s", cfg->ip.c_str(), prober.why());
+			}
+
+			lck.lock();
+			w.next_try = next_try;
+			w.busy = 0;
 		}
+
+		d_warm_cv.wait_for(lck, chrono::seconds(1));
 	}
+}
 
-	// For rfc8484, do not pass around the raw (binary) message, which would potentially
-	// be used for logging. Unused by now.
-	raw = "rfc8484 answer";
 
-	if (dns_reply.size() < sizeof(dnshdr) + 5)
-		return build_error("Invalid reply (4).", -1);
+// Send the wire query with ID 0 to the rfc8484 or DoT nameserver cfg, as is or b64url encoded
+// for GET, and check that the answer matches question. The answer has ID 0.
+int dnshttps::ask_wire(const config::a_ns_cfg &cfg, const string &id0_query, const string &b64, string_view question,
+                       string &answer, uint32_t &min_ttl)
+{
+	string req = "", reply = "", chunked = "";
+	string_view body;
+
+	answer = "";
+
+	if (cfg.dot) {
+		uint16_t id = query_id();
+		req = id0_query;
+		memcpy(&req[0], &id, sizeof(id));
+		if (transact_dot(cfg, req, reply) < 0)
+			return -1;
+		body = reply;
+	} else {
+		req = make_request(cfg, cfg.post ? id0_query : b64);
+		if (transact(cfg, req, reply, body, chunked) < 0)
+			return -1;
+	}
+
+	if (check_wire(body, question, min_ttl) < 0) {
+		syslog(LOG_INFO, "Error when checking reply from %s: %s", cfg.ip.c_str(), this->why());
+		ssl->close();
+		return -1;
+	}
+
+	// the upstream knows better how long its own cached answer is still valid
+	uint32_t max_age = no_max_age;
+	if (!cfg.dot && http_max_age(reply, max_age))
+		min_ttl = max_age;
+
+	answer = body;
+	memset(&answer[0], 0, sizeof(uint16_t));
+	return 0;
+}
+
+
+// Ask exactly the nameserver cfg for the wire query, e.g. for shadow queries.
+// The answer carries the ID of the query.
+int dnshttps::ask_ns(const config::a_ns_cfg &cfg, const string &query, string &answer)
+{
+	dns_msg qmsg(query);
+	string::size_type qname = 0, qend = string::npos;
+	uint16_t qtype = 0, qclass = 0;
+	uint32_t min_ttl = 0;
+
+	answer = "";
+
+	if (!cfg.rfc8484 && !cfg.dot)
+		return build_error("Not a rfc8484 or DoT nameserver.", -1);
+
+	if ((qend = qmsg.question(qname, qtype, qclass)) == string::npos)
+		return build_error("Invalid query.", -1);
+
+	string id0_query = query, b64 = "";
+	memset(&id0_query[0], 0, sizeof(uint16_t));
+	b64url_encode(id0_query, b64);
+	pad_query(id0_query, 0);
+
+	if (ask_wire(cfg, id0_query, b64, string_view(query.c_str() + sizeof(dnshdr), qend - sizeof(dnshdr)), answer, min_ttl) < 0)
+		return build_error("No answer from " + cfg.ip, -1);
+
+	memcpy(&answer[0], query.c_str(), sizeof(uint16_t));
+	return 0;
+}
+
+
+// harddnsd can take a while itself if upstreams fail over
+enum { local_timeout_ms = 2000 };
+
+
+// As shm_cache::attach(): the socket and its directory must belong to root or to us,
+// and nobody else may replace the socket by one of their own.
+static bool trusted_socket(const string &path)
+{
+	struct stat st;
+
+	errno = 0;
+
+	string dir = ".";
+	string::size_type idx = path.rfind('/');
+	if (idx == 0)
+		dir = "/";
+	else if (idx != string::npos)
+		dir = path.substr(0, idx);
+
+	if (lstat(path.c_str(), &st) < 0 || !S_ISSOCK(st.st_mode) || (st.st_uid != 0 && st.st_uid != geteuid()))
+		return 0;
+	if (stat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) || (st.st_uid != 0 && st.st_uid != geteuid()) ||
+	    (st.st_mode & 022) != 0)
+		return 0;
+	return 1;
+}
+
+
+// NSS: ask the harddnsd listening on the Unix datagram socket path, which shares its cache
+// and upstream connections with all processes on the host. Queries and answers are plain
+// DNS messages. Returns like get(), or -1 if the daemon is not available or failed,
+// so that the caller can fall back to DoH.
+int dnshttps::get_local(const string &path, const string &name, uint16_t qtype, dns_reply &result, string &raw)
+{
+	sockaddr_un sun, self;
+
+	raw = "";
+
+	if (!valid_name(name))
+		return build_error("Invalid FQDN", -1);
+
+	if (path.size() >= sizeof(sun.sun_path))
+		return build_error("get_local: Socket path too long.", -1);
+
+	if (!trusted_socket(path))
+		return build_error("get_local: Unsafe owner or mode of " + path, -1);
+
+	string query = make_query(name, qtype);
+	if (!query.size())
+		return build_error("get_local: Failed to create query.", -1);
+
+	// EDNS(0), so that larger answers are not truncated
+	pad_query(query, 1);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path.c_str(), path.size());
+
+	// autobind to an abstract address, so that the daemon can answer
+	memset(&self, 0, sizeof(self));
+	self.sun_family = AF_UNIX;
+
+	int sock = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return build_error("get_local::socket:", -1);
+
+	if (::bind(sock, reinterpret_cast<sockaddr *>(&self), sizeof(sa_family_t)) < 0 ||
+	    ::connect(sock, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0 ||
+	    ::send(sock, query.c_str(), query.size(), 0) != (ssize_t)query.size()) {
+		::close(sock);
+		return build_error("get_local::send:", -1);
+	}
+
+	string answer(0x10000, 0);
+	ssize_t r = -1;
+
+	pollfd pfd = {sock, POLLIN, 0};
+	if (poll(&pfd, 1, local_timeout_ms) == 1)
+		r = ::recv(sock, &answer[0], answer.size(), 0);
+	::close(sock);
 
-	const dnshdr *dhdr = reinterpret_cast<const dnshdr *>(dns_reply.c_str());
+	if (r < (ssize_t)sizeof(dnshdr) || memcmp(answer.c_str(), query.c_str(), sizeof(uint16_t)) != 0)
+		return build_error("get_local: No answer from harddnsd.", -1);
+	answer.resize(r);
 
-	if (dhdr->qr != 1)
+	// only NXDOMAIN is an answer, as opposed to SERVFAIL, REFUSED etc.
+	int rcode = dns_msg(answer).rcode();
+	if (rcode != 0 && rcode != 3)
+		return build_error("get_local: harddnsd failed to resolve.", -1);
+
+	// a truncated answer lacks its records, so it is no answer either
+	if (dns_msg(answer).tc())
+		return build_error("get_local: Truncated answer from harddnsd.", -1);
+
+	unsigned int first = reply_end(result);
+	if ((r = parse_rfc8484(name, qtype, result, raw, answer)) < 0)
+		result.erase(result.lower_bound(first), result.end());
+	raw = "(harddnsd)";
+	return r;
+}
+
+
+// Light check of a wire answer to a query with the given question section:
+// header, echoed question and all RRs must be sane. Returns the smallest TTL
+// of all RRs (0 if there are none) in min_ttl.
+int dnshttps::check_wire(string_view answer, string_view question, uint32_t &min_ttl)
+{
+	dns_msg msg(answer);
+	string::size_type qname = 0, idx = string::npos;
+	uint16_t qtype = 0, qclass = 0;
+
+	min_ttl = 0;
+
+	if (!msg.has_header() || !msg.qr())
 		return build_error("Invalid DNS header. Not a reply.", -1);
 
-	if (dhdr->rcode != 0)
-		return build_error("DNS error response from server.", 0);
+	if (msg.qd_count() != 1 || (idx = msg.question(qname, qtype, qclass)) == string::npos)
+		return build_error("Invalid reply (1).", -1);
 
-	string aname = "", cname = "", fqdn = "";
-	idx = sizeof(dnshdr);
-	int qnlen = qname2host(dns_reply, tmp, idx);
-	if (qnlen <= 0 || idx + qnlen + 2*sizeof(uint16_t) >= dns_reply.size())
-		return build_error("Invalid reply (5).", -1);
-	fqdn = lcs(tmp);
-	if (lcs(string(name + ".")) != fqdn)
-		return build_error("Wrong name in awnser.", -1);
+	// question must be echoed as is, modulo case
+	if (idx - qname != question.size() ||
+	    lcs(string(answer.substr(qname, idx - qname))) != lcs(string(question)))
+		return build_error("Wrong question in answer.", -1);
 
-	idx += qnlen + 2*sizeof(uint16_t);
-	aidx = idx;
+	unsigned int nrrs = msg.an_count() + msg.ns_count() + msg.ar_count();
+	uint32_t ttl = 0xffffffff;
+	dns_msg::rr_t rr;
 
-	uint16_t rdlen = 0, qtype = 0, qclass = 0;
-	uint32_t ttl = 0;
+	for (unsigned int i = 0; i < nrrs; ++i) {
+		if ((idx = msg.next_rr(idx, rr)) == string::npos)
+			return build_error("Invalid reply (2).", -1);
 
-	// first of all, find all CNAMEs for desired name
-	map<string, int> fqdns{{fqdn, 1}};
+		// OPT abuses the TTL field for flags
+		if (rr.qtype == htons(dns_type::OPT))
+			continue;
 
-	for (int i = 0;; ++i) {
-		if (idx >= dns_reply.size())
-			break;
+		// rfc2181 Sec. 8
+		uint32_t rr_ttl = ntohl(rr.ttl) & 0x7fffffff;
+		if (rr_ttl < ttl)
+			ttl = rr_ttl;
+	}
 
-		// also handles compressed labels
-		if ((qnlen = qname2host(dns_reply, tmp, idx)) <= 0)
-			return build_error("Invalid reply (6).", -1);
-		aname = lcs(tmp);
+	if (ttl != 0xffffffff)
+		min_ttl = ttl;
 
-		// 10 -> qtype, qclass, ttl, rdlen
-		if (idx + qnlen + 10 >= dns_reply.size())
-			return build_error("Invalid reply (7).", -1);
-		idx += qnlen;
-		qtype = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
-		idx += sizeof(uint16_t);
-		qclass = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
-		idx += sizeof(uint16_t);
-		ttl = *reinterpret_cast<const uint32_t *>(dns_reply.c_str() + idx);
-		idx += sizeof(uint32_t);
-		rdlen = ntohs(*reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx));
-		idx += sizeof(uint16_t);
-
-		if (idx + rdlen > dns_reply.size() || qclass != htons(1) || rdlen == 0)
-			return build_error("Invalid reply (8).", -1);
-
-		if (qtype == htons(dns_type::CNAME)) {
-			if (qname2host(dns_reply, tmp, idx) <= 0)
-				return build_error("Invalid reply (9).", -1);
-			cname = lcs(tmp);
+	return 0;
+}
 
-			if (fqdns.count(aname) > 0) {
-				fqdns[cname] = 1;
 
-				// For NSS module, to have fqdn aliases w/o decoding avail
-				result[acnt++] = {"NSS CNAME", 0, 0, ntohl(ttl), cname};
-			}
-		}
+// Locate the HTTP body inside reply. Content-Length replies are just viewed in place,
+// chunked bodies need to be joined into chunked first.
+int dnshttps::http_body(const string &reply, string::size_type content_idx, size_t cl, string_view &body, string &chunked)
+{
+	string::size_type idx = string::npos;
 
-		idx += rdlen;
+	if (cl > 0 && content_idx != string::npos) {
+		if (content_idx > reply.size() || reply.size() - content_idx < cl)
+			return build_error("Incomplete read from server.", -1);
+		body = string_view(reply).substr(content_idx, cl);
+		return 0;
 	}
 
-	idx = aidx;
-	for (int i = 0;; ++i) {
-		if (idx >= dns_reply.size())
+	// parse chunked encoding
+	chunked = "";
+	idx = reply.find("\r\n\r\n");
+	if (idx == string::npos || idx + 4 >= reply.size())
+		return build_error("Invalid reply (1).", -1);
+	idx += 4;
+	for (;;) {
+		string::size_type nl = reply.find("\r\n", idx);
+		if (nl == string::npos || nl + 2 > reply.size())
+			return build_error("Invalid reply (2).", -1);
+		cl = strtoul(reply.c_str() + idx, nullptr, 16);
+
+		// end of chunk?
+		if (cl == 0)
 			break;
 
-		// unlike in CNAME parsing loop, do not convert answer to lowercase,
-		// as we want to put original name into answer
-		if ((qnlen = qname2host(dns_reply, aname, idx)) <= 0)
-			return build_error("Invalid reply (10).", -1);
-
-		// 10 -> qtype, qclass, ttl, rdlen
-		if (idx + qnlen + 10 >= dns_reply.size())
-			return build_error("Invalid reply (11).", -1);
-		idx += qnlen;
-		qtype = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
-		idx += sizeof(uint16_t);
-		qclass = *reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx);
-		idx += sizeof(uint16_t);
-		ttl = *reinterpret_cast<const uint32_t *>(dns_reply.c_str() + idx);
-		idx += sizeof(uint32_t);
-		rdlen = ntohs(*reinterpret_cast<const uint16_t *>(dns_reply.c_str() + idx));
-		idx += sizeof(uint16_t);
-
-		if (idx + rdlen > dns_reply.size() || qclass != htons(1) || rdlen == 0)
-			return build_error("Invalid reply (12).", -1);
-
-		// Need to call host2qname() on orig embedded answer name,
-		// because it may contain compression
-		string qname = "";
-		if (host2qname(aname, qname) <= 0)
-			return build_error("Invalid reply (13).", -1);
-
-		answer_t dns_ans{qname, qtype, qclass, ttl};
-
-		if (qtype == htons(dns_type::A) && fqdns.count(lcs(aname)) > 0) {
-			if (rdlen != 4)
-				return build_error("Invalid reply.", -1);
-			dns_ans.rdata = dns_reply.substr(idx, 4);
-			result[acnt++] = dns_ans;
-			has_answer = 1;
-		} else if (qtype == htons(dns_type::AAAA) && fqdns.count(lcs(aname)) > 0) {
-			if (rdlen != 16)
-				return build_error("Invalid reply (14).", -1);
-			dns_ans.rdata = dns_reply.substr(idx, 16);
-			result[acnt++] = dns_ans;
-			has_answer = 1;
-		} else if (qtype == htons(dns_type::CNAME)) {
-			string qcname = "";
-			// uncompress cname answer
-			if (qname2host(dns_reply, cname, idx) <= 0)
-				return build_error("Invalid reply (15).", -1);
-			if (host2qname(cname, qcname) <= 0)
-				return build_error("Invalid reply (16).", -1);
-			dns_ans.rdata = qcname;
-			result[acnt++] = dns_ans;
-		} else if (qtype == htons(dns_type::NS) && qtype == type) {
-			//XXX: handle decompression
-			dns_ans.rdata = dns_reply.substr(idx, rdlen);
-			result[acnt++] = dns_ans;
-			has_answer = 1;
-		} else if (qtype == htons(dns_type::MX) && qtype == type) {
-			dns_ans.rdata = dns_reply.substr(idx, rdlen);
-			result[acnt++] = dns_ans;
-			has_answer = 1;
-		}
-
-		idx += rdlen;
+		if (cl > 65535 || nl + 2 + cl + 2 > reply.size())
+			return build_error("Invalid reply (3).", -1);
+		idx = nl + 2;
+		chunked.append(reply, idx, cl);
+		idx += cl + 2;
 	}
 
-	return has_answer ? 1 : 0;
+	body = chunked;
+	return 0;
 }
 
 
-int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, string &raw, const string &reply, string::size_type content_idx, size_t cl)
+// Single pass over the answer section. The CNAME chain is tracked by the offsets
+// of its owner names inside the message and compared in place, so no intermediate
+// strings are created except for what goes into the result. Like most stub resolvers
+// we rely on the server to order the chain.
+int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result, string &raw, string_view body)
 {
 	bool has_answer = 0;
+	unsigned int acnt = reply_end(result);
 
-	string::size_type idx = string::npos, idx2 = string::npos, aidx = string::npos;
-	string json = "", tmp = "";
-	unsigned int acnt = 0;
+	// For rfc8484, do not pass around the raw (binary) message, which would potentially
+	// be used for logging. Unused by now.
+	raw = "rfc8484 answer";
+	d_nodata = 0;
 
-	if (cl > 0 && content_idx != string::npos) {
-		json = reply.substr(content_idx);
-		if (json.size() < cl)
-			return build_error("Incomplete read from json server.", -1);
-	} else {
-		// parse chunked encoding
-		idx = reply.find("\r\n\r\n");
-		if (idx == string::npos || idx + 4 >= reply.size())
-			return build_error("Invalid reply (1).", -1);
-		idx += 4;
-		for (;;) {
-			string::size_type nl = reply.find("\r\n", idx);
-			if (nl == string::npos || nl + 2 > reply.size())
-				return build_error("Invalid reply.", -1);
-			cl = strtoul(reply.c_str() + idx, nullptr, 16);
-
-			// end of chunk?
-			if (cl == 0)
-				break;
+	dns_msg msg(body);
 
-			if (cl > 65535 || nl + 2 + cl + 2 > reply.size())
-				return build_error("Invalid reply.", -1);
-			idx = nl + 2;
-			json += reply.substr(idx, cl);
-			idx += cl + 2;
-		}
-	}
+	if (msg.size() < sizeof(dnshdr) + 5)
+		return build_error("Invalid reply (4).", -1);
 
-	raw = json;
-	json = lcs(raw);
+	if (!msg.qr())
+		return build_error("Invalid DNS header. Not a reply.", -1);
 
-	//printf(">>>> %s @ %s\n", name.c_str(), raw.c_str());
+	if ((d_rcode = msg.rcode()) != 0)
+		return build_error("DNS error response from server.", 0);
 
-	// Who needs boost property tree json parsers??
-	// Turns out, C++ data structures were not really made for JSON. Maybe CORBA...
-	json.erase(remove(json.begin(), json.end(), ' '), json.end());
+	string::size_type qname = 0, idx = string::npos;
+	uint16_t qtype = 0, qclass = 0;
 
-	if (json.find("\"status\":0") == string::npos)
-		return 0;
-	if ((idx = json.find("\"answer\":[")) == string::npos)
-		return 0;
-	idx += 10;
-	aidx = idx;
-
-	string::size_type brace_open = 0, brace_close = 0;
-
-	// first of all, find all CNAMEs
-	string s = lcs(name);
-	map<string, int> fqdns{{s, 1}};
-	for (int level = 0; level < 10; ++level) {
-
-		if (!valid_name(s))
-			return build_error("Invalid DNS name.", -1);
-
-		// Some servers remove the trailing "." in FQDNs in their answer,
-		// and some add it -.-
-		// So check for both versions of the answer FQDN (looking for cname answers)
-
-		string cname = "\"name\":\"" + s;
-		if (s[s.size() - 1] != '.')
-			cname += ".";
-		cname += "\",\"type\":5";
-		if ((idx = json.find(cname, aidx)) == string::npos) {
-			cname = "\"name\":\"" + s;
-			if (cname[cname.size() - 1] == '.')
-				cname.erase(cname.size() - 1, 1);
-			cname += "\",\"type\":5";
-			if ((idx = json.find(cname, aidx)) == string::npos)
-				break;
-		}
-		if ((brace_close = json.find("}", idx)) == string::npos)
-			return 0;
-		if ((brace_open = json.rfind("{", idx)) == string::npos)
-			return 0;
-		if (brace_open < aidx || brace_close < aidx)
-			return 0;
+	if ((idx = msg.question(qname, qtype, qclass)) == string::npos || idx >= msg.size())
+		return build_error("Invalid reply (5).", -1);
+	if (!msg.name_eq(qname, name))
+		return build_error("Wrong name in awnser.", -1);
 
-		// guaranteed that { comes before }
+	// offsets of all owner names that belong to the CNAME chain of the desired name
+	enum { max_chain = 16 };
+	string::size_type chain[max_chain] = {qname};
+	unsigned int nchain = 1;
 
-		string inner_json = json.substr(brace_open, brace_close - brace_open + 1);
+	dns_msg::rr_t rr;
+	string cname = "";
 
-		uint32_t ttl = 0;
-		if ((idx = inner_json.find("\"ttl\":")) == string::npos)
-			ttl = 600;
-		else
-			ttl = strtoul(inner_json.c_str() + idx + 6, nullptr, 10);
+	for (uint16_t i = 0; i < msg.an_count(); ++i) {
+		if ((idx = msg.next_rr(idx, rr)) == string::npos)
+			return build_error("Invalid reply (6).", -1);
 
-		if ((idx = inner_json.find("\"data\":\"")) == string::npos)
-			break;
-		idx += 8;
-		if ((idx2 = inner_json.find("\"", idx)) == string::npos)
-			break;
-		tmp = inner_json.substr(idx, idx2 - idx);
-		if (!valid_name(tmp))
-			return build_error("Invalid DNS name.", -1);
+		if (rr.qclass != htons(1) || rr.rdlen == 0)
+			return build_error("Invalid reply (7).", -1);
 
-		if (tmp[tmp.size() - 1] == '.')
-			tmp.erase(tmp.size() - 1, 1);
+		bool in_chain = 0;
+		for (unsigned int j = 0; j < nchain && !in_chain; ++j)
+			in_chain = msg.name_eq(chain[j], rr.name);
 
-		string qname = "", cqname = "";
-		if (host2qname(s, qname) <= 0)
-			break;
-		if (host2qname(tmp, cqname) <= 0)
-			break;
+		if (rr.qtype != htons(dns_type::CNAME) && !in_chain)
+			continue;
+
+		// Need to uncompress orig embedded answer name, keeping its case
+		answer_t dns_ans{"", rr.qtype, rr.qclass, rr.ttl};
 
-		result[acnt++] = {qname, htons(dns_type::CNAME), htons(1), htonl(ttl), cqname};
+		if (rr.qtype == htons(dns_type::A)) {
+			if (rr.rdlen != 4)
+				return build_error("Invalid reply (8).", -1);
+			dns_ans.rdata = body.substr(rr.rdata, 4);
+			has_answer = 1;
+		} else if (rr.qtype == htons(dns_type::AAAA)) {
+			if (rr.rdlen != 16)
+				return build_error("Invalid reply (9).", -1);
+			dns_ans.rdata = body.substr(rr.rdata, 16);
+			has_answer = 1;
+		} else if (rr.qtype == htons(dns_type::CNAME)) {
+			if (msg.expand(rr.rdata, dns_ans.rdata) <= 0)
+				return build_error("Invalid reply (10).", -1);
+
+			if (in_chain) {
+				if (msg.expand_host(rr.rdata, cname, 1) <= 0)
+					return build_error("Invalid reply (11).", -1);
+				if (nchain < max_chain)
+					chain[nchain++] = rr.rdata;
 
-		// for NSS module, to have fqdn alias w/o decoding avail
-		result[acnt++] = {"NSS CNAME", 0, 0, ttl, tmp};
+				// For NSS module, to have fqdn aliases w/o decoding avail
+				result[acnt++] = {"NSS CNAME", 0, 0, ntohl(rr.ttl), cname};
+			}
+		} else if ((rr.qtype == htons(dns_type::NS) || rr.qtype == htons(dns_type::PTR)) && rr.qtype == type) {
+			if (msg.expand(rr.rdata, dns_ans.rdata) <= 0)
+				return build_error("Invalid reply (12).", -1);
+			has_answer = 1;
+		} else if (rr.qtype == htons(dns_type::MX) && rr.qtype == type) {
+			// 16bit preference followed by exchange name
+			if (rr.rdlen < 3 || msg.expand(rr.rdata + 2, dns_ans.rdata) <= 0)
+				return build_error("Invalid reply (13).", -1);
+			dns_ans.rdata.insert(0, body.substr(rr.rdata, 2));
+			has_answer = 1;
+		} else
+			continue;
 
-		if (fqdns.count(s) > 0)
-			fqdns[tmp] = 1;
+		if (msg.expand(rr.name, dns_ans.name) <= 0)
+			return build_error("Invalid reply (14).", -1);
 
-		//syslog(LOG_INFO, ">>>> CNAME %s -> %s\n", s.c_str(), tmp.c_str());
-		s = tmp;
+		result[acnt++] = dns_ans;
+	}
 
-		// aidx guaranteed to stay valid by above checks
-		json.erase(brace_open, brace_close - brace_open + 1);
+	// NODATA comes with the SOA of the zone that has the last name of the chain
+	for (uint16_t i = 0; !has_answer && i < msg.ns_count(); ++i) {
+		if ((idx = msg.next_rr(idx, rr)) == string::npos)
+			break;
+		if (rr.qtype == htons(dns_type::SOA))
+			d_nodata = 1;
 	}
 
-	// now for the other records for original name and all CNAMEs
-	for (auto it = fqdns.begin(); it != fqdns.end(); ++it) {
+	return has_answer ? 1 : 0;
+}
+
+
+// Parse one object of the "Answer" or "Authority" array. Missing TTLs default to 600.
+static bool json_rr(json_tok &js, string_view &name, unsigned long &type, unsigned long &ttl, string_view &data)
+{
+	string_view key;
+
+	name = data = "";
+	type = 0;
+	ttl = 600;
+
+	if (!js.expect('{'))
+		return 0;
+	if (js.expect('}'))
+		return 1;
+
+	for (;;) {
+		if (!js.string(key) || !js.expect(':'))
+			return 0;
+
+		bool ok = 0;
+		if (json_key_eq(key, "name"))
+			ok = js.string(name);
+		else if (json_key_eq(key, "type"))
+			ok = js.number(type);
+		else if (json_key_eq(key, "ttl"))
+			ok = js.number(ttl);
+		else if (json_key_eq(key, "data"))
+			ok = js.string(data);
+		else
+			ok = js.skip_value();
+		if (!ok)
+			return 0;
 
-		if (!valid_name(it->first))
+		if (js.expect(','))
 			continue;
+		return js.expect('}');
+	}
 
-		for (;;) {
+	return 0;
+}
 
-			char data[16] = {0};
 
-			// Some servers remove the trailing "." in FQDNs in their answer,
-			// and some add it -.-
-			// So check for both versions of the answer FQDN
+// Some servers remove the trailing "." in FQDNs in their answer,
+// and some add it -.-
+static bool host_eq(string_view h1, string_view h2)
+{
+	if (h1.size() > 0 && h1[h1.size() - 1] == '.')
+		h1.remove_suffix(1);
+	if (h2.size() > 0 && h2[h2.size() - 1] == '.')
+		h2.remove_suffix(1);
+	return json_key_eq(h1, h2);
+}
 
-			string ans = "\"name\":\"" + it->first;
-			if ((it->first)[it->first.size() - 1] != '.')
-				ans += ".";
-			ans += "\",\"type\":";
-			if ((idx = json.find(ans, aidx)) == string::npos) {
 
-				ans = "\"name\":\"" + it->first;
-				if (ans[ans.size() - 1] == '.')
-					ans.erase(ans.size() - 1, 1);
-				ans += "\",\"type\":";
-				if ((idx = json.find(ans, aidx)) == string::npos)
-					break;
-			}
+// Walk the reply once and emit the records of the "Answer" array as they stream by,
+// following the CNAME chain of the desired name, which we expect the server to order.
+int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, string &raw, string_view body)
+{
+	bool has_answer = 0, has_status = 0;
+	unsigned int first = reply_end(result), acnt = first;
+	unsigned long status = 0, atype = 0, ttl = 0;
 
-			idx += ans.size();
-			uint16_t atype = (uint16_t)strtoul(json.c_str() + idx, nullptr, 10);
+	raw = string(body);
+	d_nodata = 0;
 
-			if ((brace_close = json.find("}", idx)) == string::npos)
-				return 0;
-			if ((brace_open = json.rfind("{", idx)) == string::npos)
-				return 0;
-			if (brace_open < aidx || brace_close < aidx)
-				return 0;
+	//printf(">>>> %s @ %s\n", name.c_str(), raw.c_str());
 
-			// guaranteed that { comes before }
+	// names that belong to the CNAME chain of the desired name, as views into name or body
+	enum { max_chain = 16 };
+	string_view chain[max_chain] = {name};
+	unsigned int nchain = 1;
+
+	json_tok js(body);
+	string_view key, aname, data;
+	string qname = "", cname = "", cqname = "";
+
+	if (!js.expect('{'))
+		return build_error("Invalid JSON reply (1).", -1);
+
+	for (bool more = !js.expect('}'); more;) {
+		if (!js.string(key) || !js.expect(':'))
+			return build_error("Invalid JSON reply (2).", -1);
+
+		if (json_key_eq(key, "Status")) {
+			if (!js.number(status))
+				return build_error("Invalid JSON reply (3).", -1);
+			has_status = 1;
+		} else if (json_key_eq(key, "Answer")) {
+			if (!js.expect('['))
+				return build_error("Invalid JSON reply (4).", -1);
+
+			for (bool more_rrs = !js.expect(']'); more_rrs;) {
+				if (!json_rr(js, aname, atype, ttl, data))
+					return build_error("Invalid JSON reply (5).", -1);
+				if (!js.expect(',')) {
+					if (!js.expect(']'))
+						return build_error("Invalid JSON reply (6).", -1);
+					more_rrs = 0;
+				}
 
-			string inner_json = json.substr(brace_open, brace_close - brace_open + 1);
+				bool in_chain = 0;
+				for (unsigned int j = 0; j < nchain && !in_chain; ++j)
+					in_chain = host_eq(chain[j], aname);
+				if (!in_chain || !valid_name(aname))
+					continue;
 
-			uint32_t ttl = 0;
-			if ((idx = inner_json.find("\"ttl\":")) == string::npos)
-				ttl = 600;
-			else
-				ttl = strtoul(inner_json.c_str() + idx + 6, nullptr, 10);
+				if (host2qname(string(aname), qname) <= 0)
+					continue;
 
-			if ((idx = inner_json.find("\"data\":\"")) == string::npos)
-				break;
-			idx += 8;
-			if ((idx2 = inner_json.find("\"", idx)) == string::npos)
-				break;
-			tmp = inner_json.substr(idx, idx2 - idx);
+				answer_t dns_ans{qname, htons(atype), htons(1), htonl(ttl)};
 
-			string qname = "";
-			if (host2qname(it->first, qname) <= 0)
-				break;
+				if (atype == dns_type::CNAME) {
+					if (!valid_name(data))
+						return build_error("Invalid DNS name.", -1);
 
-			answer_t dns_ans{qname, htons(atype), htons(1), htonl(ttl)};
+					cname = lcs(string(data));
+					if (cname[cname.size() - 1] == '.')
+						cname.erase(cname.size() - 1, 1);
+					if (host2qname(cname, cqname) <= 0)
+						continue;
 
-			if (atype == dns_type::A) {
-				if (inet_pton(AF_INET, tmp.c_str(), data) == 1) {
-					dns_ans.rdata = string(data, 4);
+					dns_ans.rdata = cqname;
 					result[acnt++] = dns_ans;
-					has_answer = 1;
-				}
-			} else if (atype == dns_type::AAAA) {
-				if (inet_pton(AF_INET6, tmp.c_str(), data) == 1) {
-					dns_ans.rdata = string(data, 16);
+
+					// for NSS module, to have fqdn alias w/o decoding avail
+					result[acnt++] = {"NSS CNAME", 0, 0, (uint32_t)ttl, cname};
+
+					//syslog(LOG_INFO, ">>>> CNAME %s -> %s\n", string(aname).c_str(), cname.c_str());
+					if (nchain < max_chain)
+						chain[nchain++] = data;
+				} else if (atype == dns_type::A || atype == dns_type::AAAA) {
+					char ip[64] = {0}, addr[16] = {0};
+					if (data.size() >= sizeof(ip))
+						continue;
+					data.copy(ip, data.size());
+
+					int af = atype == dns_type::A ? AF_INET : AF_INET6;
+					if (inet_pton(af, ip, addr) == 1) {
+						dns_ans.rdata = string(addr, af == AF_INET ? 4 : 16);
+						result[acnt++] = dns_ans;
+						has_answer = 1;
+					}
+				} else if (atype == dns_type::NS || (atype == dns_type::PTR && htons(atype) == type)) {
+					if (!valid_name(data))
+						return build_error("Invalid DNS name.", -1);
+
+					if (host2qname(string(data), qname) <= 0)
+						continue;
+					dns_ans.rdata = qname;
 					result[acnt++] = dns_ans;
 					has_answer = 1;
 				}
-			} else if (atype == dns_type::NS) {
-				if (!valid_name(tmp))
-					return build_error("Invalid DNS name.", -1);
-
-				if (tmp[tmp.size() - 1] == '.')
-					tmp.erase(tmp.size() - 1, 1);
-
-				if (host2qname(tmp, qname) <= 0)
-					break;
-				dns_ans.rdata = qname;
-				result[acnt++] = dns_ans;
-				has_answer = 1;
-			} else if (type == dns_type::MX) {
 			}
+		} else if (json_key_eq(key, "Authority")) {
+			if (!js.expect('['))
+				return build_error("Invalid JSON reply (9).", -1);
+
+			for (bool more_rrs = !js.expect(']'); more_rrs;) {
+				if (!json_rr(js, aname, atype, ttl, data))
+					return build_error("Invalid JSON reply (10).", -1);
+				if (!js.expect(',')) {
+					if (!js.expect(']'))
+						return build_error("Invalid JSON reply (11).", -1);
+					more_rrs = 0;
+				}
+				if (atype == dns_type::SOA)
+					d_nodata = 1;
+			}
+		} else if (!js.skip_value())
+			return build_error("Invalid JSON reply (7).", -1);
 
-			// aidx guaranteed to stay valid by above checks
-			json.erase(brace_open, brace_close - brace_open + 1);
-		}
+		if (js.expect(','))
+			continue;
+		if (!js.expect('}'))
+			return build_error("Invalid JSON reply (8).", -1);
+		more = 0;
+	}
+
+	// No or bad status, which may only be known after the records went by
+	d_rcode = has_status ? (int)status : 2;
+	if (!has_status || status != 0) {
+		for (unsigned int i = first; i < acnt; ++i)
+			result.erase(i);
+		return 0;
 	}
 
+	d_nodata = d_nodata && !has_answer;
 	return has_answer ? 1 : 0;
 }
 
@@ -23,8 +23,15 @@
 
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <map>
+#include <vector>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "ssl.h"
+#include "config.h"
 
 
 namespace harddns {
@@ -33,7 +40,46 @@ class dnshttps {
 
 	std::string err;
 
-	ssl_box *ssl;
+	ssl_box *ssl, *d_orig;
+
+	// rcode (or dns-json Status) of the last parsed answer, and whether it
+	// was a NODATA with the SOA of the zone in the authority section (rfc2308)
+	int d_rcode{0};
+
+	bool d_nodata{0};
+
+	// harddnsd: connections kept warm, each to its own nameserver. They are swapped
+	// with ssl when a query goes to their nameserver.
+	// They are (re-)connected and probed by a worker thread, which owns a box while it's busy.
+	struct warm_t {
+		ssl_box *box;
+		const config::a_ns_cfg *cfg;
+		time_t next_try;
+		bool busy;
+	};
+
+	std::vector<warm_t> d_warm;
+
+	std::mutex d_warm_mtx;
+
+	std::condition_variable d_warm_cv;
+
+	std::thread d_warm_thread;
+
+	bool d_warm_stop{0};
+
+	time_t d_last_maintain{0};
+
+	// select_policy = hash: nameservers grouped by provider, and until when
+	// a nameserver is skipped after it failed
+	struct group_t {
+		uint64_t hash;
+		std::vector<const config::a_ns_cfg *> ns;
+	};
+
+	std::vector<group_t> d_groups;
+
+	std::map<std::string, time_t> d_down;
 
 	template<class T>
 	T build_error(const std::string &msg, T r)
@@ -68,30 +114,78 @@ public:
 
 private:
 
-	int parse_rfc8484(const std::string &, uint16_t, dns_reply &, std::string &, const std::string &, std::string::size_type, size_t);
+	const config::a_ns_cfg *next_ns(bool, bool no_peer = 0);
+
+	int send_request(const config::a_ns_cfg &, std::string &);
+
+	int transact(const config::a_ns_cfg &, std::string &, std::string &, std::string_view &, std::string &);
+
+	int transact_dot(const config::a_ns_cfg &, const std::string &, std::string &);
+
+	int http_body(const std::string &, std::string::size_type, size_t, std::string_view &, std::string &);
+
+	int parse_json(const std::string &, uint16_t, dns_reply &, std::string &, std::string_view);
+
+	int check_wire(std::string_view, std::string_view, uint32_t &);
 
-	int parse_json(const std::string &, uint16_t, dns_reply &, std::string &, const std::string &, std::string::size_type, size_t);
+	int ask_wire(const config::a_ns_cfg &, const std::string &, const std::string &, std::string_view, std::string &, uint32_t &);
+
+	void take_warm(const std::string &, bool, bool = 0);
+
+	void hash_order(const std::string &, bool, std::vector<const config::a_ns_cfg *> &);
+
+	void mark_down(const config::a_ns_cfg &);
+
+	void warm_worker();
 
 
 
 public:
 
 	dnshttps(ssl_box *s)
-		: ssl(s)
+		: ssl(s), d_orig(s)
 	{
 	}
 
-	virtual ~dnshttps()
-	{
-		// don't delete ssl
-	}
+	virtual ~dnshttps();
 
 	const char *why()
 	{
 		return err.c_str();
 	}
 
-	int get(const std::string &, uint16_t, dns_reply &, std::string &);
+	// no Cache-Control max-age in the HTTP reply
+	enum : uint32_t { no_max_age = 0xffffffff };
+
+	int get(const std::string &, uint16_t, dns_reply &, std::string &, uint32_t &);
+
+	// also used by build/bench
+	int parse_rfc8484(const std::string &, uint16_t, dns_reply &, std::string &, std::string_view);
+
+	int get(const std::string &name, uint16_t qtype, dns_reply &result, std::string &raw)
+	{
+		uint32_t max_age = no_max_age;
+		return get(name, qtype, result, raw, max_age);
+	}
+
+	int get_wire(const std::string &, std::string &, uint32_t &);
+
+	// whether the last parsed answer says that the end of its CNAME chain has
+	// no records of the asked type, so that there is no point in asking again
+	bool negative() const
+	{
+		return d_rcode == 3 || d_nodata;
+	}
+
+	int ask_ns(const config::a_ns_cfg &, const std::string &, std::string &);
+
+	int get_local(const std::string &, const std::string &, uint16_t, dns_reply &, std::string &);
+
+	int probe(const config::a_ns_cfg &);
+
+	int init_warm();
+
+	void maintain();
 
 };
 
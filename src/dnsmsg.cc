@@ -0,0 +1,334 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <arpa/inet.h>
+#include "dnsmsg.h"
+#include "net-headers.h"
+
+
+namespace harddns {
+
+using namespace std;
+using namespace net_headers;
+
+
+// RFC1035: 255 octets wire length, 63 per label
+enum { max_name_len = 255, max_label_len = 63, max_jumps = 16 };
+
+
+static uint16_t get16(const char *p)
+{
+	uint16_t x = 0;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+
+static uint32_t get32(const char *p)
+{
+	uint32_t x = 0;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+
+static inline char lc(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+
+bool dns_msg::has_header() const
+{
+	return d_msg.size() >= sizeof(dnshdr);
+}
+
+
+uint16_t dns_msg::id() const
+{
+	return has_header() ? get16(d_msg.data()) : 0;
+}
+
+
+bool dns_msg::qr() const
+{
+	return has_header() && (d_msg[2] & 0x80);
+}
+
+
+bool dns_msg::tc() const
+{
+	return has_header() && (d_msg[2] & 0x02);
+}
+
+
+bool dns_msg::cd() const
+{
+	return has_header() && (d_msg[3] & 0x10);
+}
+
+
+int dns_msg::rcode() const
+{
+	return has_header() ? (d_msg[3] & 0x0f) : -1;
+}
+
+
+uint16_t dns_msg::qd_count() const
+{
+	return has_header() ? ntohs(get16(d_msg.data() + 4)) : 0;
+}
+
+
+uint16_t dns_msg::an_count() const
+{
+	return has_header() ? ntohs(get16(d_msg.data() + 6)) : 0;
+}
+
+
+uint16_t dns_msg::ns_count() const
+{
+	return has_header() ? ntohs(get16(d_msg.data() + 8)) : 0;
+}
+
+
+uint16_t dns_msg::ar_count() const
+{
+	return has_header() ? ntohs(get16(d_msg.data() + 10)) : 0;
+}
+
+
+// Advance to the next label of the name at off, following compression pointers.
+// Returns the label length (0 for the root label) and the label data offset in label,
+// or -1 on malformed names.
+int dns_msg::next_label(string::size_type &off, string::size_type &label, int &jumps) const
+{
+	for (;;) {
+		if (off >= d_msg.size())
+			return -1;
+
+		uint8_t len = d_msg[off];
+
+		if ((len & 0xc0) == 0xc0) {
+			if (off + 1 >= d_msg.size() || ++jumps > max_jumps)
+				return -1;
+			off = ((len & 0x3f)<<8)|(d_msg[off + 1] & 0xff);
+			continue;
+		}
+		if (len > max_label_len)
+			return -1;
+		if (off + 1 + len > d_msg.size())
+			return -1;
+
+		label = off + 1;
+		off += 1 + len;
+		return len;
+	}
+
+	return -1;
+}
+
+
+// skip the (possibly compressed) name at off and return the offset of the
+// data that follows it inside the message, or npos
+string::size_type dns_msg::skip_name(string::size_type off) const
+{
+	size_t total = 0;
+
+	for (;;) {
+		if (off >= d_msg.size())
+			return string::npos;
+
+		uint8_t len = d_msg[off];
+
+		if ((len & 0xc0) == 0xc0)
+			return off + 2 <= d_msg.size() ? off + 2 : string::npos;
+		if (len > max_label_len)
+			return string::npos;
+		if ((total += len + 1) > max_name_len)
+			return string::npos;
+
+		off += 1 + len;
+		if (len == 0)
+			return off;
+	}
+
+	return string::npos;
+}
+
+
+// case insensitive compare of two (possibly compressed) names inside the message
+bool dns_msg::name_eq(string::size_type off1, string::size_type off2) const
+{
+	string::size_type l1 = 0, l2 = 0;
+	int j1 = 0, j2 = 0, len1 = 0, len2 = 0;
+
+	for (size_t total = 0; total <= max_name_len;) {
+		if ((len1 = next_label(off1, l1, j1)) < 0 || (len2 = next_label(off2, l2, j2)) < 0)
+			return 0;
+		if (len1 != len2)
+			return 0;
+		if (len1 == 0)
+			return 1;
+		for (int i = 0; i < len1; ++i) {
+			if (lc(d_msg[l1 + i]) != lc(d_msg[l2 + i]))
+				return 0;
+		}
+		total += len1 + 1;
+	}
+
+	return 0;
+}
+
+
+// case insensitive compare of the name at off with a dotted host name,
+// with or without trailing "."
+bool dns_msg::name_eq(string::size_type off, string_view host) const
+{
+	string::size_type label = 0, pos = 0;
+	int jumps = 0, len = 0;
+
+	if (host.size() > 0 && host[host.size() - 1] == '.')
+		host.remove_suffix(1);
+
+	for (size_t total = 0; total <= max_name_len;) {
+		if ((len = next_label(off, label, jumps)) < 0)
+			return 0;
+		if (len == 0)
+			return pos >= host.size();
+		if (pos >= host.size())
+			return 0;
+
+		string_view::size_type dot = host.find('.', pos);
+		if (dot == string_view::npos)
+			dot = host.size();
+		if (dot - pos != (size_t)len)
+			return 0;
+		for (int i = 0; i < len; ++i) {
+			if (lc(d_msg[label + i]) != lc(host[pos + i]))
+				return 0;
+		}
+		pos = dot + 1;
+		total += len + 1;
+	}
+
+	return 0;
+}
+
+
+// "\003foo\300\014" -> "\003foo\003bar\000", returns length of expanded qname or -1
+int dns_msg::expand(string::size_type off, string &qname) const
+{
+	string::size_type label = 0;
+	int jumps = 0, len = 0;
+
+	qname = "";
+
+	for (;;) {
+		if ((len = next_label(off, label, jumps)) < 0)
+			return -1;
+		if (qname.size() + len + 1 > max_name_len)
+			return -1;
+		qname += (char)len;
+		if (len == 0)
+			break;
+		qname.append(d_msg.data() + label, len);
+	}
+
+	return qname.size();
+}
+
+
+// "\003foo\300\014" -> "foo.bar.", returns length of host or -1
+int dns_msg::expand_host(string::size_type off, string &host, bool lower) const
+{
+	string::size_type label = 0;
+	int jumps = 0, len = 0;
+
+	host = "";
+
+	for (;;) {
+		if ((len = next_label(off, label, jumps)) < 0)
+			return -1;
+		if (len == 0)
+			break;
+		if (host.size() + len + 1 > max_name_len)
+			return -1;
+		if (lower) {
+			for (int i = 0; i < len; ++i)
+				host += lc(d_msg[label + i]);
+		} else
+			host.append(d_msg.data() + label, len);
+		host += ".";
+	}
+
+	return host.size();
+}
+
+
+// parse the (first) question; returns offset of the answer section or npos
+string::size_type dns_msg::question(string::size_type &qname, uint16_t &qtype, uint16_t &qclass) const
+{
+	if (!has_header() || qd_count() < 1)
+		return string::npos;
+
+	qname = sizeof(dnshdr);
+	string::size_type off = skip_name(qname);
+	if (off == string::npos || off + 2*sizeof(uint16_t) > d_msg.size())
+		return string::npos;
+
+	qtype = get16(d_msg.data() + off);
+	qclass = get16(d_msg.data() + off + sizeof(uint16_t));
+
+	return off + 2*sizeof(uint16_t);
+}
+
+
+// parse the RR at off; returns offset of the next RR or npos
+string::size_type dns_msg::next_rr(string::size_type off, rr_t &rr) const
+{
+	rr.name = off;
+	if ((off = skip_name(off)) == string::npos)
+		return string::npos;
+
+	// qtype, qclass, ttl, rdlen
+	if (off + 10 > d_msg.size())
+		return string::npos;
+
+	const char *p = d_msg.data() + off;
+	rr.qtype = get16(p);
+	rr.qclass = get16(p + 2);
+	rr.ttl = get32(p + 4);
+	rr.rdlen = ntohs(get16(p + 8));
+	rr.rdata = off + 10;
+
+	if (rr.rdata + rr.rdlen > d_msg.size())
+		return string::npos;
+
+	return rr.rdata + rr.rdlen;
+}
+
+
+}
+
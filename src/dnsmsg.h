@@ -0,0 +1,106 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_dnsmsg_h
+#define harddns_dnsmsg_h
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+
+namespace harddns {
+
+
+// Read-only view over a DNS wire message. Nothing is copied: names are
+// passed around as offsets into the message and are compared in place,
+// following compression pointers as needed. The underlying buffer must
+// outlive the view.
+class dns_msg {
+
+	std::string_view d_msg;
+
+	int next_label(std::string::size_type &, std::string::size_type &, int &) const;
+
+public:
+
+	// one RR as found in the message; qtype, qclass and ttl are kept in
+	// network order, as in dnshttps::answer_t
+	struct rr_t {
+		std::string::size_type name, rdata;
+		uint16_t qtype, qclass, rdlen;
+		uint32_t ttl;
+	};
+
+	explicit dns_msg(std::string_view msg)
+		: d_msg(msg)
+	{
+	}
+
+	std::string_view data() const
+	{
+		return d_msg;
+	}
+
+	size_t size() const
+	{
+		return d_msg.size();
+	}
+
+	bool has_header() const;
+
+	uint16_t id() const;
+
+	bool qr() const;
+
+	bool tc() const;
+
+	bool cd() const;
+
+	int rcode() const;
+
+	uint16_t qd_count() const;
+
+	uint16_t an_count() const;
+
+	uint16_t ns_count() const;
+
+	uint16_t ar_count() const;
+
+	std::string::size_type skip_name(std::string::size_type) const;
+
+	bool name_eq(std::string::size_type, std::string::size_type) const;
+
+	bool name_eq(std::string::size_type, std::string_view) const;
+
+	int expand(std::string::size_type, std::string &) const;
+
+	int expand_host(std::string::size_type, std::string &, bool lower = 0) const;
+
+	std::string::size_type question(std::string::size_type &, uint16_t &, uint16_t &) const;
+
+	std::string::size_type next_rr(std::string::size_type, rr_t &) const;
+};
+
+
+}
+
+#endif
+
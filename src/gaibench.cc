@@ -0,0 +1,137 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Multithreaded getaddrinfo() benchmark: N threads each resolve M names and the
+// wall time of the whole run is reported. It goes through the libc, so the NSS module
+// has to be installed and listed in /etc/nsswitch.conf to be measured.
+//
+// The names are taken round robin. A "%u" in a name is replaced by a running number,
+// so that every lookup asks for a new name and no cache answers it, e.g.
+//   gaibench -t 16 -n 4 'host%u.example.com'
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+
+using namespace std;
+
+
+static double now_ms()
+{
+	timespec ts = {0, 0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+
+static string expand(const string &name, unsigned int n)
+{
+	string::size_type idx = name.find("%u");
+	if (idx == string::npos)
+		return name;
+	return name.substr(0, idx) + to_string(n) + name.substr(idx + 2);
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned int nthreads = 4, nnames = 1;
+	int c = 0, family = AF_UNSPEC;
+
+	while ((c = getopt(argc, argv, "t:n:46")) != -1) {
+		switch (c) {
+		case 't':
+			nthreads = strtoul(optarg, nullptr, 10);
+			break;
+		case 'n':
+			nnames = strtoul(optarg, nullptr, 10);
+			break;
+		case '4':
+			family = AF_INET;
+			break;
+		case '6':
+			family = AF_INET6;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	if (optind >= argc || nthreads == 0 || nnames == 0) {
+		fprintf(stderr, "Usage: %s [-t threads] [-n names per thread] [-4|-6] name...\n", argv[0]);
+		return 1;
+	}
+
+	vector<string> names(argv + optind, argv + argc);
+	atomic<unsigned int> next{0}, ok{0}, failed{0};
+	vector<double> slowest(nthreads, 0);
+	vector<thread> threads;
+
+	double start = now_ms();
+
+	for (unsigned int t = 0; t < nthreads; ++t) {
+		threads.emplace_back([&, t] {
+			addrinfo hints, *res = nullptr;
+
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = family;
+			hints.ai_socktype = SOCK_STREAM;
+
+			for (unsigned int i = 0; i < nnames; ++i) {
+				unsigned int n = next++;
+				string name = expand(names[n % names.size()], n);
+
+				double t0 = now_ms();
+				if (getaddrinfo(name.c_str(), nullptr, &hints, &res) == 0) {
+					freeaddrinfo(res);
+					++ok;
+				} else
+					++failed;
+
+				if (now_ms() - t0 > slowest[t])
+					slowest[t] = now_ms() - t0;
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	double wall = now_ms() - start, max = 0;
+	for (auto s : slowest)
+		max = s > max ? s : max;
+
+	printf("%u threads x %u names: %u ok, %u failed, wall %.3fs, slowest lookup %.1fms\n",
+	       nthreads, nnames, ok.load(), failed.load(), wall/1000, max);
+
+	return failed > 0;
+}
+
@@ -24,6 +24,8 @@
 #include <syslog.h>
 #include "config.h"
 #include "ssl.h"
+#include "sessions.h"
+#include "aimd.h"
 #include "dnshttps.h"
 
 extern "C" {
@@ -77,9 +79,14 @@ void harddns_init(const string &cfg_base)
 	OpenSSL_add_all_digests();
 	ERR_clear_error();
 
-	if (!(harddns::ssl_conn = new (nothrow) harddns::ssl_box))
+	if (!(harddns::ssl_sessions = new (nothrow) harddns::session_store(harddns::config::tls_session_dir)))
 		return;
 
+	if (!(harddns::ssl_conn = new (nothrow) harddns::ssl_box(harddns::ssl_sessions)))
+		return;
+
+	harddns::upstream_limits = new (nothrow) harddns::aimd(harddns::config::max_inflight);
+
 	harddns::ssl_conn->setup_ctx();
 
 	load_certificates();
@@ -94,6 +101,8 @@ void harddns_fini()
 {
 	delete harddns::ssl_conn;
 	delete harddns::dns;
+	delete harddns::ssl_sessions;
+	delete harddns::upstream_limits;
 
 	delete harddns::config::ns;
 	delete harddns::config::ns_cfg;
@@ -7,6 +7,9 @@ extern void harddns_init(const std::string &);
 
 extern void harddns_fini();
 
+// NSS: harddns_init() once, on the first lookup; thread-safe
+extern void harddns_nss_init();
+
 #endif
 
 
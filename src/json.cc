@@ -0,0 +1,170 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <string_view>
+#include <cctype>
+#include "json.h"
+
+
+namespace harddns {
+
+using namespace std;
+
+
+// dns-json replies are flat, anything nested deeper is not ours
+enum { max_depth = 16 };
+
+
+void json_tok::skip_ws()
+{
+	while (d_pos < d_s.size() && isspace(static_cast<unsigned char>(d_s[d_pos])))
+		++d_pos;
+}
+
+
+bool json_tok::peek(char c)
+{
+	skip_ws();
+	return d_pos < d_s.size() && d_s[d_pos] == c;
+}
+
+
+bool json_tok::expect(char c)
+{
+	if (!peek(c))
+		return 0;
+	++d_pos;
+	return 1;
+}
+
+
+bool json_tok::string(string_view &sv)
+{
+	if (!expect('"'))
+		return 0;
+
+	string_view::size_type start = d_pos;
+	for (; d_pos < d_s.size(); ++d_pos) {
+		if (d_s[d_pos] == '\\') {
+			++d_pos;
+			continue;
+		}
+		if (d_s[d_pos] == '"') {
+			sv = d_s.substr(start, d_pos - start);
+			++d_pos;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+bool json_tok::number(unsigned long &n)
+{
+	skip_ws();
+
+	string_view::size_type start = d_pos;
+	n = 0;
+	for (; d_pos < d_s.size() && isdigit(static_cast<unsigned char>(d_s[d_pos])); ++d_pos) {
+		if (n < 0xffffffff)
+			n = n*10 + (d_s[d_pos] - '0');
+	}
+
+	// fraction or exponent, which are not expected in dns-json
+	while (d_pos < d_s.size() && (d_s[d_pos] == '.' || d_s[d_pos] == 'e' || d_s[d_pos] == 'E' ||
+	       d_s[d_pos] == '+' || d_s[d_pos] == '-' || isdigit(static_cast<unsigned char>(d_s[d_pos]))))
+		++d_pos;
+
+	return d_pos > start;
+}
+
+
+bool json_tok::skip_value()
+{
+	string_view sv;
+	unsigned long n = 0;
+
+	skip_ws();
+	if (d_pos >= d_s.size())
+		return 0;
+
+	switch (d_s[d_pos]) {
+	case '"':
+		return string(sv);
+	case '{':
+	case '[': {
+		char close = d_s[d_pos] == '{' ? '}' : ']';
+		if (++d_depth > max_depth)
+			return 0;
+		++d_pos;
+		if (expect(close)) {
+			--d_depth;
+			return 1;
+		}
+		for (;;) {
+			if (close == '}' && (!string(sv) || !expect(':')))
+				return 0;
+			if (!skip_value())
+				return 0;
+			if (expect(','))
+				continue;
+			if (!expect(close))
+				return 0;
+			break;
+		}
+		--d_depth;
+		return 1;
+	}
+	case '-':
+		++d_pos;
+		return number(n);
+	default:
+		if (isdigit(static_cast<unsigned char>(d_s[d_pos])))
+			return number(n);
+
+		// true, false, null
+		if (!isalpha(static_cast<unsigned char>(d_s[d_pos])))
+			return 0;
+		while (d_pos < d_s.size() && isalpha(static_cast<unsigned char>(d_s[d_pos])))
+			++d_pos;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+// Keys in dns-json differ in case between providers ("TTL" vs "ttl")
+bool json_key_eq(string_view key, string_view want)
+{
+	if (key.size() != want.size())
+		return 0;
+	for (string_view::size_type i = 0; i < key.size(); ++i) {
+		if (tolower(static_cast<unsigned char>(key[i])) != tolower(static_cast<unsigned char>(want[i])))
+			return 0;
+	}
+	return 1;
+}
+
+
+}
+
@@ -0,0 +1,68 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_json_h
+#define harddns_json_h
+
+#include <string>
+#include <string_view>
+
+
+namespace harddns {
+
+
+// Minimal streaming JSON tokenizer, just enough to walk a dns-json reply
+// once from front to back. Strings are returned as views into the input,
+// with escapes left as they are.
+class json_tok {
+
+	std::string_view d_s;
+
+	std::string_view::size_type d_pos{0};
+
+	int d_depth{0};
+
+	void skip_ws();
+
+public:
+
+	explicit json_tok(std::string_view s)
+		: d_s(s)
+	{
+	}
+
+	bool peek(char);
+
+	bool expect(char);
+
+	bool string(std::string_view &);
+
+	bool number(unsigned long &);
+
+	bool skip_value();
+};
+
+
+bool json_key_eq(std::string_view, std::string_view);
+
+}
+
+#endif
+
@@ -18,6 +18,7 @@
  */
 
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <cctype>
 #include <algorithm>
@@ -151,7 +152,7 @@ int qname2host(const string &msg, string &result, string::size_type start_idx)
 
 
 // check charset, dont check label size
-bool valid_name(const string &name)
+bool valid_name(string_view name)
 {
 	size_t l = name.size();
 	if (l > 254 || l < 2)
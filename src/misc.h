@@ -22,6 +22,7 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <cctype>
 
 namespace harddns {
@@ -30,7 +31,7 @@ int host2qname(const std::string &, std::string &);
 
 int qname2host(const std::string &, std::string &, std::string::size_type idx = 0);
 
-bool valid_name(const std::string &);
+bool valid_name(std::string_view);
 
 std::string A2PTR_fqdn(const std::string &);
 
@@ -1,19 +1,29 @@
 
-// glue code to make harddns inited for the NSS DSO load
+// glue code to make harddns inited for the NSS DSO, on the first lookup
+// rather than at load time, as most processes never resolve a name
 
+#include <mutex>
 #include "init.h"
 
 
-extern "C" void harddns_nss_init() __attribute__((constructor));
-extern "C" void harddns_nss_init()
+static std::once_flag init_once;
+
+static bool inited = 0;
+
+
+void harddns_nss_init()
 {
-	harddns_init("/etc/harddns");
+	std::call_once(init_once, [] {
+		harddns_init("/etc/harddns");
+		inited = 1;
+	});
 }
 
 
 extern "C" void harddns_nss_fini() __attribute__((destructor));
 extern "C" void harddns_nss_fini()
 {
-	harddns_fini();
+	if (inited)
+		harddns_fini();
 }
 
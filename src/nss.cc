@@ -30,7 +30,14 @@
 #include <netdb.h>
 #include <signal.h>
 #include <map>
+#include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <pthread.h>
+#include <atomic>
+#include <ctime>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -39,6 +46,10 @@
 #include "dnshttps.h"
 #include "config.h"
 #include "ssl.h"
+#include "shmcache.h"
+#include "addrconf.h"
+#include "misc.h"
+#include "init.h"
 
 
 #define ALIGN(x) (((x) + __SIZEOF_POINTER__ - 1) & ~(__SIZEOF_POINTER__ - 1))
@@ -76,8 +87,432 @@ int main(int argc, char **argv)
 }
 #endif
 
-// Not more than 1 thread to ask for a question at the same time
-mutex ssl_mtx;
+// Resolver contexts, each with its own connection, so that up to config::nss_contexts
+// threads may ask at the same time. The first is the global dns/ssl_conn pair of
+// harddns_init(), the others are created on demand. Idle ones are reused most
+// recently used first, so the fewest connections are kept busy.
+class nss_ctx_pool {
+public:
+
+	struct ctx_t {
+		ssl_box *ssl;
+		dnshttps *dns;
+	};
+
+private:
+
+	vector<ctx_t> d_idle, d_created;
+
+	unsigned int d_count{0};
+
+	bool d_failed{0};
+
+	// the global ssl_conn/dns went into the pool; it is never handed out twice,
+	// even if a fork lost it
+	bool d_shared_used{0};
+
+	mutex d_mtx;
+
+	condition_variable d_cv;
+
+	bool create(bool, ctx_t &);
+
+public:
+
+	nss_ctx_pool();
+
+	// runs at exit before the destructor of nss-init, so ssl_conn and ssl_sessions are still there
+	~nss_ctx_pool()
+	{
+		for (auto &c : d_created) {
+			if (c.dns == dns)
+				continue;
+			delete c.dns;
+			delete c.ssl;
+		}
+	}
+
+	ctx_t acquire(bool);
+
+	void release(const ctx_t &);
+
+	void fork_prepare();
+
+	void fork_parent();
+
+	void fork_child();
+};
+
+
+static nss_ctx_pool ctx_pool;
+
+
+// at load time, so a fork() during the first lookup is covered too
+nss_ctx_pool::nss_ctx_pool()
+{
+	pthread_atfork([] { ctx_pool.fork_prepare(); }, [] { ctx_pool.fork_parent(); }, [] { ctx_pool.fork_child(); });
+}
+
+
+bool nss_ctx_pool::create(bool shared, ctx_t &c)
+{
+	if (shared) {
+		c = {ssl_conn, dns};
+		return dns != nullptr;
+	}
+
+	if (!ssl_conn || !(c.ssl = new (nothrow) ssl_box(ssl_sessions)))
+		return 0;
+	if (c.ssl->setup_ctx() < 0 || !(c.dns = new (nothrow) dnshttps(c.ssl))) {
+		syslog(LOG_INFO, "nss: no resolver context: %s", c.ssl->why());
+		delete c.ssl;
+		return 0;
+	}
+	c.ssl->share_pinned(*ssl_conn);
+	return 1;
+}
+
+
+// Take an idle context, create one if below the limit, or if wait is set, wait for one
+// to be released. Returns {nullptr, nullptr} if there is none.
+nss_ctx_pool::ctx_t nss_ctx_pool::acquire(bool wait)
+{
+	ctx_t c{nullptr, nullptr};
+	unsigned int limit = config::nss_contexts > 0 ? config::nss_contexts : 1;
+
+	unique_lock<mutex> g(d_mtx);
+
+	for (;;) {
+		if (d_idle.size() > 0) {
+			c = d_idle.back();
+			d_idle.pop_back();
+			return c;
+		}
+		if (d_count == 0 && d_failed)
+			return c;
+		if (d_count < limit && !d_failed) {
+			bool shared = !d_shared_used;
+			d_shared_used = 1;
+			++d_count;
+
+			// setting up a context loads the CA certs, don't block the others meanwhile
+			g.unlock();
+			bool ok = create(shared, c);
+			g.lock();
+
+			if (ok) {
+				d_created.push_back(c);
+				return c;
+			}
+
+			// don't try again, but make do with what we have
+			--d_count;
+			d_failed = 1;
+			c = {nullptr, nullptr};
+			d_cv.notify_all();
+			continue;
+		}
+		if (!wait)
+			return c;
+		d_cv.wait(g);
+	}
+
+	return c;
+}
+
+
+void nss_ctx_pool::release(const ctx_t &c)
+{
+	{
+		lock_guard<mutex> g(d_mtx);
+		d_idle.push_back(c);
+	}
+	d_cv.notify_one();
+}
+
+
+// Keep the pool consistent across fork(), so the child knows which contexts are idle,
+// and wait until no thread is inside OpenSSL, whose locks the child could not take otherwise
+void nss_ctx_pool::fork_prepare()
+{
+	ssl_box::fork_prepare();
+	d_mtx.lock();
+}
+
+
+void nss_ctx_pool::fork_parent()
+{
+	d_mtx.unlock();
+	ssl_box::fork_release();
+}
+
+
+// The child shares the connections with the parent. Drop them quietly, without calling
+// into OpenSSL, which keeps their sessions, so the child's first lookup resumes instead of
+// corrupting the parent's TLS stream. Contexts that other threads were using are left
+// alone, as they are in the middle of a lookup that no thread in the child will ever
+// finish, and no longer count against the limit.
+void nss_ctx_pool::fork_child()
+{
+	for (auto &c : d_idle)
+		c.ssl->abandon();
+
+	for (auto it = d_created.begin(); it != d_created.end();) {
+		if (find_if(d_idle.begin(), d_idle.end(), [it](const ctx_t &c) { return c.dns == it->dns; }) == d_idle.end()) {
+			it = d_created.erase(it);
+			--d_count;
+		} else
+			++it;
+	}
+
+	// the threads that waited for a context in the parent are not here
+	new (&d_cv) condition_variable;
+
+	d_mtx.unlock();
+	ssl_box::fork_release();
+}
+
+
+class nss_ctx_lease {
+
+	nss_ctx_pool::ctx_t d_ctx{nullptr, nullptr};
+
+public:
+
+	// no context at all if take is not set
+	explicit nss_ctx_lease(bool wait = 1, bool take = 1)
+		: d_ctx(take ? ctx_pool.acquire(wait) : nss_ctx_pool::ctx_t{nullptr, nullptr})
+	{
+	}
+
+	~nss_ctx_lease()
+	{
+		if (d_ctx.dns)
+			ctx_pool.release(d_ctx);
+	}
+
+	nss_ctx_lease(const nss_ctx_lease &) = delete;
+
+	nss_ctx_lease &operator=(const nss_ctx_lease &) = delete;
+
+	dnshttps *dns()
+	{
+		return d_ctx.dns;
+	}
+};
+
+
+// Answers of this process by {name, family}, with AF_UNSPEC for gethostbyname4_r
+// and af_ptr for reverse lookups. Answers without records are kept as negative
+// entries for negative_ttl.
+struct nss_cache_elem_t {
+	dnshttps::dns_reply res;
+	time_t valid_until;
+};
+
+static map<pair<string, int>, nss_cache_elem_t> nss_cache;
+
+static mutex cache_mtx;
+
+enum { negative_ttl = 60, af_ptr = -1 };
+
+
+static bool is_addr(const dnshttps::answer_t &a)
+{
+	return a.qtype == htons(dns_type::A) || a.qtype == htons(dns_type::AAAA);
+}
+
+
+// the records that were asked for, whose TTL counts
+static bool is_answer(const dnshttps::answer_t &a)
+{
+	return is_addr(a) || a.qtype == htons(dns_type::PTR);
+}
+
+
+static bool cache_lookup(const char *name, int af, dnshttps::dns_reply &res)
+{
+	if (!config::nss_cache)
+		return 0;
+
+	lock_guard<mutex> g(cache_mtx);
+
+	auto it = nss_cache.find({lcs(name), af});
+	if (it == nss_cache.end())
+		return 0;
+
+	time_t now = time(nullptr);
+	if (it->second.valid_until <= now) {
+		nss_cache.erase(it);
+		return 0;
+	}
+
+	res = it->second.res;
+	for (auto &a : res) {
+		if (is_answer(a.second))
+			a.second.ttl = htonl(it->second.valid_until - now);
+	}
+
+	return 1;
+}
+
+
+static void cache_insert(const char *name, int af, const dnshttps::dns_reply &res)
+{
+	if (!config::nss_cache)
+		return;
+
+	uint32_t ttl = 0xffffffff;
+	for (auto &a : res) {
+		if (is_answer(a.second) && ntohl(a.second.ttl) < ttl)
+			ttl = ntohl(a.second.ttl);
+	}
+	if (ttl == 0xffffffff)
+		ttl = negative_ttl;
+	if (ttl == 0)
+		return;
+
+	lock_guard<mutex> g(cache_mtx);
+
+	time_t now = time(nullptr);
+	auto key = make_pair(lcs(name), af);
+
+	// make room: drop what expired, or else what expires first
+	if (nss_cache.size() >= config::nss_cache && nss_cache.count(key) == 0) {
+		for (auto it = nss_cache.begin(); it != nss_cache.end();) {
+			if (it->second.valid_until <= now)
+				it = nss_cache.erase(it);
+			else
+				++it;
+		}
+		if (nss_cache.size() >= config::nss_cache) {
+			auto first = nss_cache.begin();
+			for (auto it = nss_cache.begin(); it != nss_cache.end(); ++it) {
+				if (it->second.valid_until < first->second.valid_until)
+					first = it;
+			}
+			nss_cache.erase(first);
+		}
+	}
+
+	nss_cache[key] = {res, now + ttl};
+}
+
+
+// Reverse lookups look for the address among the forward answers cached first,
+// and take the name of the record it was found in
+static bool learned_lookup(const string &rdata, string &host, uint32_t &ttl)
+{
+	if (!config::nss_cache)
+		return 0;
+
+	lock_guard<mutex> g(cache_mtx);
+
+	time_t now = time(nullptr);
+	for (auto &e : nss_cache) {
+		if (e.second.valid_until <= now)
+			continue;
+		for (auto &a : e.second.res) {
+			if (is_addr(a.second) && a.second.rdata == rdata && qname2host(a.second.name, host) > 0) {
+				ttl = e.second.valid_until - now;
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static addr_config addrs;
+
+
+// The shared cache of harddnsd, mapped on first use. If harddnsd was not up yet,
+// try again every 10s.
+static atomic<shm_cache *> shm{nullptr};
+
+static const shm_cache *shared_cache()
+{
+	static mutex mtx;
+	static time_t next_try = 0;
+
+	if (config::shm_cache.empty())
+		return nullptr;
+
+	shm_cache *c = shm.load(memory_order_acquire);
+	if (c)
+		return c;
+
+	unique_lock<mutex> g(mtx, try_to_lock);
+	time_t now = time(nullptr);
+	if (!g.owns_lock() || now < next_try)
+		return nullptr;
+	next_try = now + 10;
+
+	if ((c = new (nothrow) shm_cache) && c->attach(config::shm_cache) == 0) {
+		shm.store(c, memory_order_release);
+		return c;
+	}
+
+	delete c;
+	return nullptr;
+}
+
+
+// Fill res from the shared cache if it has all wanted families of name
+static bool shared_lookup(const char *name, bool want_a, bool want_aaaa, dnshttps::dns_reply &res)
+{
+	const shm_cache *shm = shared_cache();
+	shm_cache::entry_t e4, e6;
+
+	if (!shm)
+		return 0;
+	if (want_a && !shm->lookup(name, htons(dns_type::A), e4))
+		return 0;
+	if (want_aaaa && !shm->lookup(name, htons(dns_type::AAAA), e6))
+		return 0;
+
+	unsigned int idx = 0;
+	for (uint8_t i = 0; want_a && i < e4.naddr; ++i)
+		res[idx++] = {name, htons(dns_type::A), htons(1), htonl(e4.ttl), string(e4.addrs[i], 4)};
+	for (uint8_t i = 0; want_aaaa && i < e6.naddr; ++i)
+		res[idx++] = {name, htons(dns_type::AAAA), htons(1), htonl(e6.ttl), string(e6.addrs[i], 16)};
+
+	return 1;
+}
+
+
+// Ask the local harddnsd if configured, and DoH ourself only if it is not available
+static int nss_get(dnshttps *d, const string &name, uint16_t qtype, dnshttps::dns_reply &res, string &raw)
+{
+	if (config::nss_socket.size()) {
+		int r = d->get_local(config::nss_socket, name, qtype, res, raw);
+
+		// harddnsd only knows the PTRs that it made up from its own forward answers (-P)
+		if (r > 0 || (r == 0 && qtype != htons(dns_type::PTR)))
+			return r;
+		if (config::log_requests)
+			syslog(LOG_INFO, "%s", d->why());
+	}
+
+	return d->get(name, qtype, res, raw);
+}
+
+// The upstream resolver follows the CNAME chain as far as it can and returns all of it,
+// so if the answer that starts at first in res has no addresses, only the name its chain
+// ends with is left to ask for. Returns "" if the answer had no CNAMEs.
+static string chain_tail(const dnshttps::dns_reply &res, unsigned int first)
+{
+	string tail = "";
+
+	for (auto it = res.lower_bound(first); it != res.end(); ++it) {
+		if (it->second.name == "NSS CNAME")
+			tail = it->second.rdata;
+	}
+
+	return tail;
+}
+
 
 /* Most of the alloc/idx code was taken from libvirt and systemd-resolv nss modules. Interestingly
  * they are almost equal, including their comments and asserts.
@@ -106,31 +541,36 @@ do_nss_harddns_gethostbyname3_r(const char *name, int af, struct hostent *result
 	dnshttps::dns_reply res;
 	string raw = "";
 
-	{
-		lock_guard<mutex> g(ssl_mtx);
+	if (cache_lookup(name, af, res)) {
+		if (config::log_requests)
+			syslog(LOG_INFO, "nss %s %s? -> (cached)", name, af == AF_INET ? "A" : "AAAA");
+	} else {
+		nss_ctx_lease ctx;
+		dnshttps *d = ctx.dns();
 
-		if (!dns)
+		if (!d)
 			return NSS_STATUS_TRYAGAIN;
 
-		// up to 5 levels of DNS recursion for CNAMEs
+		// up to 5 queries along the CNAME chain
 		string s = name;
 		for (i = 0; s.size() > 0 && i < 5; ++i) {
-			r = dns->get(s, qtype, res, raw);
+			unsigned int first = res.size() > 0 ? res.rbegin()->first + 1 : 0;
+			r = nss_get(d, s, qtype, res, raw);
 			if (config::log_requests)
 				syslog(LOG_INFO, "nss %s %s? -> %s", s.c_str(), af == AF_INET ? "A" : "AAAA", raw.c_str());
 			if (r < 0) {
-				syslog(LOG_INFO, "%s", dns->why());
+				syslog(LOG_INFO, "%s", d->why());
 				return NSS_STATUS_TRYAGAIN;
 			} else if (r == 1)	// found something
 				break;
-			s = "";
-			unsigned int level = 0;
-			for (auto it = res.begin(); it != res.end() && s.size() == 0; ++it) {
-				if (it->second.name == "NSS CNAME" && level++ == i) {
-					s = it->second.rdata;
-				}
-			}
+
+			// the resolver followed the chain already and says there is nothing at its end
+			if (d->negative())
+				break;
+			s = chain_tail(res, first);
 		}
+
+		cache_insert(name, af, res);
 	}
 
 	naddr = 0;
@@ -242,6 +682,8 @@ _nss_harddns_gethostbyname3_r(const char *name, int af, struct hostent *result,
 	new_sig.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &new_sig, &old_sig);
 
+	harddns_nss_init();
+
 	enum nss_status r = do_nss_harddns_gethostbyname3_r(name, af, result, buffer, buflen, errnop, herrnop, ttlp, canonp);
 
 	sigaction(SIGPIPE, &old_sig, nullptr);
@@ -266,50 +708,118 @@ do_nss_harddns_gethostbyname4_r(const char *name, struct gaih_addrtuple **pat,
 	dnshttps::dns_reply res;
 	string raw = "";
 
-	{
-		lock_guard<mutex> g(ssl_mtx);
+	bool want_a = 1, want_aaaa = (_res.options & RES_USE_INET6) || config::nss_aaaa;
+
+	// the shared cache first, the cheapest of all
+	bool shared = shared_lookup(name, want_a, want_aaaa, res);
+
+	// don't ask for what the host could not connect to anyway
+	if (config::nss_addrconfig) {
+		bool a = want_a, aaaa = want_aaaa;
+		addrs.families(want_a, want_aaaa);
 
-		if (!dns)
+		if (shared) {
+			for (auto i = res.begin(); i != res.end();) {
+				if ((!want_a && i->second.qtype == htons(dns_type::A)) ||
+				    (!want_aaaa && i->second.qtype == htons(dns_type::AAAA)))
+					i = res.erase(i);
+				else
+					++i;
+			}
+		} else if (a != want_a || aaaa != want_aaaa)
+			shared = shared_lookup(name, want_a, want_aaaa, res);
+	}
+
+	// the same as gethostbyname3_r if only one family is asked
+	int af = want_a ? (want_aaaa ? AF_UNSPEC : AF_INET) : AF_INET6;
+	const char *asked = want_a ? (want_aaaa ? "A/AAAA" : "A") : "AAAA";
+
+	if (shared) {
+		if (config::log_requests)
+			syslog(LOG_INFO, "nss %s %s? -> (shared cache)", name, asked);
+	} else if (cache_lookup(name, af, res)) {
+		if (config::log_requests)
+			syslog(LOG_INFO, "nss %s %s? -> (cached)", name, asked);
+	} else {
+		nss_ctx_lease ctx;
+		dnshttps *d = ctx.dns();
+
+		if (!d)
 			return NSS_STATUS_TRYAGAIN;
 
-		// up to 5 levels of DNS CNAME recursion
+		// Ask for AAAA in parallel on a second context if one is free right away,
+		// otherwise after A on this one. Never wait for it, as the holder of the
+		// one we would wait for might be waiting for ours.
+		nss_ctx_lease ctx6(0, want_a && want_aaaa);
+		dnshttps *d6 = ctx6.dns();
+
+		// up to 5 queries along the CNAME chain
 		string s = name;
 		for (int i = 0; s.size() > 0 && i < 5; ++i) {
 
+			unsigned int first = res.size() > 0 ? res.rbegin()->first + 1 : 0;
+			dnshttps::dns_reply res6;
+			string raw6 = "";
+			int r6 = 0;
+			thread aaaa;
+			dnshttps *da = d;
+
+			if (d6) {
+				try {
+					aaaa = thread([&] { r6 = nss_get(d6, s, htons(dns_type::AAAA), res6, raw6); });
+					da = d6;
+				} catch (...) {
+				}
+			}
+
 			// A
-			r = dns->get(s, htons(dns_type::A), res, raw);
-			if (config::log_requests)
-				syslog(LOG_INFO, "nss %s A? -> %s", s.c_str(), raw.c_str());
-			if (r < 0) {
-				syslog(LOG_INFO, "%s", dns->why());
-				return NSS_STATUS_TRYAGAIN;
-			} else if (r == 1)
-				naddr = 1;
-
-			if ((_res.options & RES_USE_INET6) || config::nss_aaaa) {
-				// AAAA
-				r = dns->get(s, htons(dns_type::AAAA), res, raw);
-				if (raw.size() && config::log_requests)
-					syslog(LOG_INFO, "nss %s AAAA? -> %s", s.c_str(), raw.c_str());
+			if (want_a)
+				r = nss_get(d, s, htons(dns_type::A), res, raw);
+
+			// AAAA
+			if (aaaa.joinable())
+				aaaa.join();
+			else if (want_aaaa)
+				r6 = nss_get(da, s, htons(dns_type::AAAA), res6, raw6);
+
+			if (want_a) {
+				if (config::log_requests)
+					syslog(LOG_INFO, "nss %s A? -> %s", s.c_str(), raw.c_str());
 				if (r < 0) {
-					syslog(LOG_INFO, "%s", dns->why());
+					syslog(LOG_INFO, "%s", d->why());
+					return NSS_STATUS_TRYAGAIN;
+				} else if (r == 1)
+					naddr = 1;
+			}
+
+			if (want_aaaa) {
+				if (raw6.size() && config::log_requests)
+					syslog(LOG_INFO, "nss %s AAAA? -> %s", s.c_str(), raw6.c_str());
+				if (r6 < 0) {
+					syslog(LOG_INFO, "%s", da->why());
 					return NSS_STATUS_TRYAGAIN;
-				} else if (r == 1) {
+				} else if (r6 == 1) {
 					naddr = 1;
 				}
+
+				// the CNAMEs are the same in both answers, only add the addresses
+				unsigned int n = res.size() > 0 ? res.rbegin()->first + 1 : 0;
+				for (auto &a : res6) {
+					if (!want_a || a.second.qtype == htons(dns_type::AAAA))
+						res[n++] = a.second;
+				}
 			}
 
 			if (naddr == 1)
 				break;
 
-			s = "";
-			int level = 0;
-			for (auto it = res.begin(); s.size() == 0 && it != res.end(); ++it) {
-				if (it->second.name == "NSS CNAME" && level++ == i) {
-					s = it->second.rdata;
-				}
-			}
+			// the resolver followed the chain already and says there is nothing at its end
+			if ((!want_a || d->negative()) && (!want_aaaa || da->negative()))
+				break;
+			s = chain_tail(res, first);
 		}
+
+		cache_insert(name, af, res);
 	}
 
 	naddr = 0;
@@ -347,8 +857,8 @@ do_nss_harddns_gethostbyname4_r(const char *name, struct gaih_addrtuple **pat,
 	for (auto it = res.begin(); it != res.end(); ++it) {
 		if (it->second.qtype != htons(dns_type::A) && it->second.qtype != htons(dns_type::AAAA))
 			continue;
-		if (ttl > it->second.ttl)
-			ttl = it->second.ttl;
+		if (ttl > ntohl(it->second.ttl))
+			ttl = ntohl(it->second.ttl);
 		r_tuple = reinterpret_cast<struct gaih_addrtuple *>(buffer + idx);
 		if (++i == naddr)
 			r_tuple->next = nullptr;
@@ -386,6 +896,8 @@ _nss_harddns_gethostbyname4_r(const char *name, struct gaih_addrtuple **pat,
 	new_sig.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &new_sig, &old_sig);
 
+	harddns_nss_init();
+
 	enum nss_status r = do_nss_harddns_gethostbyname4_r(name, pat, buffer, buflen, errnop, herrnop, ttlp);
 
 	sigaction(SIGPIPE, &old_sig, nullptr);
@@ -418,3 +930,149 @@ _nss_harddns_gethostbyname2_r(const char *name, int af, struct hostent *result,
 }
 
 
+static enum nss_status
+do_nss_harddns_gethostbyaddr2_r(const void *addr, socklen_t len, int af, struct hostent *result,
+                              char *buffer, size_t buflen, int *errnop,
+                              int *herrnop, int32_t *ttlp)
+{
+	uint32_t ttl = 60*60;
+	char *r_name = nullptr, **r_aliases = nullptr, *r_addr = nullptr, **r_addr_list = nullptr;
+	size_t nameLen = 0, need = 0, idx = 0;
+	int alen = 0, r = 0;
+
+	if (af == AF_INET)
+		alen = 4;
+	else if (af == AF_INET6)
+		alen = 16;
+
+	if (alen == 0 || len != (socklen_t)alen) {
+		*errnop = EAFNOSUPPORT;
+		*herrnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	string rdata(reinterpret_cast<const char *>(addr), alen), host = "";
+	string ptr_name = af == AF_INET ? A2PTR_fqdn(rdata) : AAAA2PTR_fqdn(rdata);
+
+	dnshttps::dns_reply res;
+	string raw = "";
+
+	if (learned_lookup(rdata, host, ttl)) {
+		if (config::log_requests)
+			syslog(LOG_INFO, "nss %s PTR? -> (learned)", ptr_name.c_str());
+	} else if (cache_lookup(ptr_name.c_str(), af_ptr, res)) {
+		if (config::log_requests)
+			syslog(LOG_INFO, "nss %s PTR? -> (cached)", ptr_name.c_str());
+	} else {
+		nss_ctx_lease ctx;
+		dnshttps *d = ctx.dns();
+
+		if (!d)
+			return NSS_STATUS_TRYAGAIN;
+
+		r = nss_get(d, ptr_name, htons(dns_type::PTR), res, raw);
+		if (config::log_requests)
+			syslog(LOG_INFO, "nss %s PTR? -> %s", ptr_name.c_str(), raw.c_str());
+		if (r < 0) {
+			syslog(LOG_INFO, "%s", d->why());
+			return NSS_STATUS_TRYAGAIN;
+		}
+
+		cache_insert(ptr_name.c_str(), af_ptr, res);
+	}
+
+	for (auto it = res.begin(); host.empty() && it != res.end(); ++it) {
+		if (it->second.qtype == htons(dns_type::PTR) && qname2host(it->second.rdata, host) > 0)
+			ttl = ntohl(it->second.ttl);
+	}
+
+	if (host.size() > 0 && host[host.size() - 1] == '.')
+		host.erase(host.size() - 1, 1);
+	if (host.empty())
+		return NSS_STATUS_NOTFOUND;
+
+	/* Found and have data */
+
+	nameLen = host.size();
+
+	/* We need space for:
+	 * a) name
+	 * b) empty aliases array
+	 * c) address
+	 * d) address pointer array */
+	need = ALIGN(nameLen + 1) + sizeof(char *) + ALIGN(alen) + 2 * sizeof(char *);
+
+	if (buflen < need) {
+		*errnop = ENOMEM;
+		*herrnop = TRY_AGAIN;
+		return NSS_STATUS_TRYAGAIN;
+	}
+
+	/* First, append name */
+	r_name = buffer;
+	memcpy(r_name, host.c_str(), nameLen + 1);
+	idx = ALIGN(nameLen + 1);
+
+	/* Second, the aliases */
+	r_aliases = reinterpret_cast<char **>(buffer + idx);
+	r_aliases[0] = nullptr;
+	idx += sizeof(char *);
+
+	/* Third, the address that was asked for */
+	r_addr = buffer + idx;
+	memcpy(r_addr, addr, alen);
+	idx += ALIGN(alen);
+
+	/* Fourth, append address pointer array */
+	r_addr_list = reinterpret_cast<char **>(buffer + idx);
+	r_addr_list[0] = r_addr;
+	r_addr_list[1] = nullptr;
+	idx += 2 * sizeof(char *);
+
+	result->h_name = r_name;
+	result->h_aliases = r_aliases;
+	result->h_addrtype = af;
+	result->h_length = alen;
+	result->h_addr_list = r_addr_list;
+
+	if (ttlp)
+		*ttlp = (int32_t)ttl;
+
+	/* Explicitly reset all error variables */
+	*errnop = 0;
+	*herrnop = NETDB_SUCCESS;
+	h_errno = 0;
+
+	return NSS_STATUS_SUCCESS;
+}
+
+
+extern "C" enum nss_status
+_nss_harddns_gethostbyaddr2_r(const void *addr, socklen_t len, int af, struct hostent *result,
+                              char *buffer, size_t buflen, int *errnop,
+                              int *herrnop, int32_t *ttlp)
+{
+	struct sigaction new_sig, old_sig;
+	memset(&new_sig, 0, sizeof(new_sig));
+	new_sig.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &new_sig, &old_sig);
+
+	harddns_nss_init();
+
+	enum nss_status r = do_nss_harddns_gethostbyaddr2_r(addr, len, af, result, buffer, buflen, errnop, herrnop, ttlp);
+
+	sigaction(SIGPIPE, &old_sig, nullptr);
+	return r;
+}
+
+
+extern "C" enum nss_status
+_nss_harddns_gethostbyaddr_r(const void *addr, socklen_t len, int af, struct hostent *result,
+                             char *buffer, size_t buflen, int *errnop,
+                             int *herrnop)
+{
+	return _nss_harddns_gethostbyaddr2_r(addr, len, af, result, buffer, buflen,
+	                                     errnop, herrnop, nullptr);
+}
+
+
@@ -20,6 +20,8 @@
 
 #include <map>
 #include <string>
+#include <vector>
+#include <string_view>
 #include <cstring>
 #include <utility>
 #include <stdint.h>
@@ -27,10 +29,15 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include "misc.h"
 #include "proxy.h"
+#include "dnsmsg.h"
 #include "config.h"
 #include "net-headers.h"
 
@@ -55,13 +62,44 @@ int doh_proxy::init(const string &laddr, const string &lport)
 	if (::bind(d_sock, ai->ai_addr, ai->ai_addrlen) < 0)
 		return build_error("init::bind:", -1);
 
+	// NSS modules of all users may ask us instead of doing DoH themselves
+	if (config::nss_socket.size()) {
+		sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (config::nss_socket.size() >= sizeof(sun.sun_path))
+			return build_error("init: nss_socket path too long.", -1);
+		memcpy(sun.sun_path, config::nss_socket.c_str(), config::nss_socket.size());
+
+		unlink(sun.sun_path);
+		if ((d_nss_sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+			return build_error("init::socket:", -1);
+		if (::bind(d_nss_sock, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0 || chmod(sun.sun_path, 0666) < 0)
+			return build_error("init::bind: " + config::nss_socket, -1);
+	}
+
 	// No need to create a dnshttp object, it was globally created
 
+	// but the warm connections need their CA certs before we chroot
+	if (config::warm_connections > 0 && dns->init_warm() < 0)
+		syslog(LOG_INFO, "No warm connections: %s", dns->why());
+
+	if (!config::shadow_ns.empty() && (d_shadow = new (nothrow) shadow) && d_shadow->init(*ssl_conn) < 0)
+		syslog(LOG_INFO, "No shadow nameservers: %s", d_shadow->why());
+
+	if (config::shm_cache.size() && (d_shm = new (nothrow) shm_cache) && d_shm->create(config::shm_cache) < 0) {
+		syslog(LOG_INFO, "No shared cache: %s", d_shm->why());
+		delete d_shm;
+		d_shm = nullptr;
+	}
+
 	return 0;
 }
 
 
-void doh_proxy::cache_insert(const string &fqdn, uint16_t qtype, const dnshttps::dns_reply &reply)
+// Cache reply for the smallest TTL of its records, or for max_age if the
+// upstream announced that via HTTP.
+void doh_proxy::cache_insert(const string &fqdn, uint16_t qtype, const dnshttps::dns_reply &reply, uint32_t max_age)
 {
 	timeval tv;
 	gettimeofday(&tv, nullptr);
@@ -97,9 +135,20 @@ void doh_proxy::cache_insert(const string &fqdn, uint16_t qtype, const dnshttps:
 		if (min_ttl > ntohl(i->second.ttl))
 			min_ttl = ntohl(i->second.ttl);
 	}
+	if (max_age != dnshttps::no_max_age)
+		min_ttl = max_age;
 
 	cache_elem_t elem{reply, tv.tv_sec + min_ttl};
 	d_rr_cache[{fqdn, qtype}] = elem;
+
+	if (d_shm && (qtype == htons(dns_type::A) || qtype == htons(dns_type::AAAA))) {
+		vector<string> addrs;
+		for (auto i = reply.begin(); i != reply.end(); ++i) {
+			if (i->second.qtype == qtype && i->second.name.find("NSS ") != 0)
+				addrs.push_back(i->second.rdata);
+		}
+		d_shm->publish(fqdn, qtype, addrs, tv.tv_sec + min_ttl);
+	}
 }
 
 
@@ -189,34 +238,229 @@ int doh_proxy::forward_answer(const string &ns, const string &fqdn, uint16_t id,
 }
 
 
+// Largest UDP answer the client takes: 512, or what it announced in its EDNS(0) OPT RR
+static size_t client_udp_size(const dns_msg &query, string::size_type idx)
+{
+	size_t max_udp = 512;
+	unsigned int nrrs = query.an_count() + query.ns_count() + query.ar_count();
+	dns_msg::rr_t rr;
+
+	for (unsigned int i = 0; i < nrrs; ++i) {
+		if ((idx = query.next_rr(idx, rr)) == string::npos)
+			break;
+		if (rr.qtype == htons(dns_type::OPT) && ntohs(rr.qclass) > max_udp)
+			max_udp = ntohs(rr.qclass);
+	}
+
+	return max_udp;
+}
+
+
+// What else in the clients query shapes the answer: whether it has EDNS(0) at all, its DO bit
+// and the CD bit. Wire answers are only shared among queries that agree (RFC 6891 6.1.1).
+static uint8_t answer_flavor(const dns_msg &query, string::size_type idx)
+{
+	uint8_t flavor = query.cd() ? 4 : 0;
+	unsigned int nrrs = query.an_count() + query.ns_count() + query.ar_count();
+	dns_msg::rr_t rr;
+
+	for (unsigned int i = 0; i < nrrs; ++i) {
+		if ((idx = query.next_rr(idx, rr)) == string::npos)
+			break;
+		if (rr.qtype != htons(dns_type::OPT))
+			continue;
+		flavor |= 1;
+		if (ntohl(rr.ttl) & 0x8000)
+			flavor |= 2;
+	}
+
+	return flavor;
+}
+
+
+// Count down the TTLs of all RRs inside a cached wire answer by the seconds it has been cached
+static void age_ttls(string &answer, uint32_t elapsed)
+{
+	dns_msg msg(answer);
+	string::size_type qname = 0, idx = string::npos;
+	uint16_t qtype = 0, qclass = 0;
+
+	if ((idx = msg.question(qname, qtype, qclass)) == string::npos)
+		return;
+
+	unsigned int nrrs = msg.an_count() + msg.ns_count() + msg.ar_count();
+	dns_msg::rr_t rr;
+
+	for (unsigned int i = 0; i < nrrs; ++i) {
+		if ((idx = msg.next_rr(idx, rr)) == string::npos)
+			break;
+		if (rr.qtype == htons(dns_type::OPT))
+			continue;
+
+		uint32_t ttl = ntohl(rr.ttl) & 0x7fffffff;
+		ttl = ttl > elapsed ? htonl(ttl - elapsed) : 0;
+
+		// ttl is followed by 16bit rdlen
+		memcpy(&answer[rr.rdata - sizeof(uint16_t) - sizeof(uint32_t)], &ttl, sizeof(ttl));
+	}
+}
+
+
+// Publish the A/AAAA records of a checked wire answer, which all belong to the
+// CNAME chain of the question, in the shared cache
+void doh_proxy::publish_wire(const string &fqdn, uint16_t qtype, const string &answer, time_t expires)
+{
+	if (qtype != htons(dns_type::A) && qtype != htons(dns_type::AAAA))
+		return;
+
+	dns_msg msg(answer);
+	string::size_type qname = 0, idx = string::npos;
+	uint16_t qt = 0, qclass = 0;
+
+	if ((idx = msg.question(qname, qt, qclass)) == string::npos)
+		return;
+
+	uint16_t alen = qtype == htons(dns_type::A) ? 4 : 16;
+	vector<string> addrs;
+	dns_msg::rr_t rr;
+
+	for (unsigned int i = 0; i < msg.an_count(); ++i) {
+		if ((idx = msg.next_rr(idx, rr)) == string::npos)
+			return;
+		if (rr.qtype == qtype && rr.rdlen == alen)
+			addrs.push_back(answer.substr(rr.rdata, alen));
+	}
+
+	d_shm->publish(fqdn, qtype, addrs, expires);
+}
+
+
+// Passthrough mode: hand the clients wire query as is to a rfc8484 upstream and its answer
+// back to the client, without decoding it into a dns_reply and re-encoding. This way we
+// can serve any qtype, not just A/AAAA.
+int doh_proxy::passthrough(int sock, const string &fqdn, const char *buf, size_t blen, const sockaddr *from, socklen_t flen)
+{
+	timeval tv;
+	gettimeofday(&tv, nullptr);
+
+	dns_msg query(string_view(buf, blen));
+	string::size_type qname = 0, qend = string::npos;
+	uint16_t qtype = 0, qclass = 0;
+
+	if ((qend = query.question(qname, qtype, qclass)) == string::npos)
+		return build_error("passthrough: Invalid query.", -1);
+
+	string answer = "";
+	auto key = make_tuple(lcs(fqdn), qtype, answer_flavor(query, qend));
+	bool from_cache = 0;
+	long usec = -1;
+
+	auto it = d_wire_cache.find(key);
+	if (qclass == htons(1) && it != d_wire_cache.end() && it->second.valid_until > tv.tv_sec) {
+		answer = it->second.answer;
+		age_ttls(answer, tv.tv_sec - it->second.inserted);
+
+		// clients ID and spelling of the question (0x20 randomization)
+		memcpy(&answer[0], buf, sizeof(uint16_t));
+		memcpy(&answer[qname], buf + qname, qend - qname);
+		from_cache = 1;
+	} else {
+		if (it != d_wire_cache.end())
+			d_wire_cache.erase(it);
+
+		uint32_t min_ttl = 0;
+		timeval start = tv;
+		if (dns->get_wire(string(buf, blen), answer, min_ttl) < 0) {
+			syslog(LOG_INFO, "proxy %s -> %s", fqdn.c_str(), dns->why());
+
+			// SERVFAIL
+			answer = string(buf, qend);
+			answer[2] |= 0x80;
+			answer[3] = (char)(0x80|2);
+			memset(&answer[6], 0, 3*sizeof(uint16_t));
+		} else {
+			// sampled for the shadow nameservers once the client has its answer
+			if (d_shadow) {
+				timeval end = {0, 0};
+				gettimeofday(&end, nullptr);
+				usec = (end.tv_sec - start.tv_sec)*1000000 + end.tv_usec - start.tv_usec;
+			}
+
+			// positive answers and NXDOMAIN/NODATA that carry a SOA
+			int rcode = answer[3] & 0x0f;
+			if (qclass == htons(1) && min_ttl > 0 && (rcode == 0 || rcode == 3)) {
+				d_wire_cache[key] = {answer, tv.tv_sec, tv.tv_sec + min_ttl};
+				if (d_shm)
+					publish_wire(fqdn, qtype, answer, tv.tv_sec + min_ttl);
+			}
+		}
+	}
+
+	if (config::log_requests)
+		syslog(LOG_INFO, "proxy %s %d? -> %s", fqdn.c_str(), ntohs(qtype), from_cache ? "(cached)" : "(passthrough)");
+
+	// Too large for the client: header and question only with TC bit set, so it retries via TCP.
+	// Not for the NSS modules, their Unix datagrams carry up to 64k.
+	string truncated = "";
+	const string *out = &answer;
+	if (sock != d_nss_sock && answer.size() > client_udp_size(query, qend)) {
+		truncated = answer.substr(0, qend);
+		truncated[2] |= 0x02;
+		memset(&truncated[6], 0, 3*sizeof(uint16_t));
+		out = &truncated;
+	}
+
+	ssize_t r = sendto(sock, out->c_str(), out->size(), 0, from, flen);
+
+	if (usec >= 0)
+		d_shadow->sample(string(buf, blen), answer, usec);
+
+	if (r != (ssize_t)out->size())
+		return build_error("passthrough::sendto():", -1);
+
+	return 0;
+}
+
+
 int doh_proxy::loop()
 {
 	int r = 0;
 	char buf[4096] = {0};
-	sockaddr_in from4;
-	sockaddr_in6 from6;
-	sockaddr *from = reinterpret_cast<sockaddr *>(&from4);
-	socklen_t flen = sizeof(from4);
+	sockaddr_storage from_ss;
+	sockaddr *from = reinterpret_cast<sockaddr *>(&from_ss);
+	socklen_t flen = sizeof(from_ss);
 	dnshdr *query = nullptr, answer;
 	string fqdn = "", qname = "", raw = "", reply = "";
 	dnshttps::dns_reply result;
 	uint16_t qtype = 0, qclass = 0;
 
-	if (d_af == AF_INET6) {
-		from = reinterpret_cast<sockaddr *>(&from6);
-		flen = sizeof(from6);
-	}
-
 	answer.qr = 1;
 	answer.ra = 1;
 	answer.q_count = htons(1);
 
 	for (;;) {
 		memset(buf, 0, sizeof(buf));
-		memset(from, 0, flen);
+		memset(from, 0, sizeof(from_ss));
+		flen = sizeof(from_ss);
+
+		// where the query came in, and the answer goes out
+		int sock = d_sock;
+
+		// keep the upstream connection open while waiting for clients
+		if (config::warm_connections > 0)
+			dns->maintain();
+
+		if (config::warm_connections > 0 || d_nss_sock >= 0) {
+			pollfd pfds[2] = {{d_sock, POLLIN, 0}, {d_nss_sock, POLLIN, 0}};
+			if (poll(pfds, d_nss_sock >= 0 ? 2 : 1, config::warm_connections > 0 ? 1000 : -1) <= 0)
+				continue;
+			if (!(pfds[0].revents & POLLIN) && (pfds[1].revents & POLLIN))
+				sock = d_nss_sock;
+		}
 
-		if ((r = recvfrom(d_sock, buf, sizeof(buf), 0, from, &flen)) <= 0)
+		if ((r = recvfrom(sock, buf, sizeof(buf), 0, from, &flen)) <= 0)
 			continue;
+		size_t blen = r;
 
 		errno = 0;
 
@@ -245,6 +489,8 @@ int doh_proxy::loop()
 		// on fqdn and ID. Its up to the client to verify that the answer is legit;
 		// we are just forwarding from/to internal DNS server.
 		if (query->qr == 1) {
+			if (sock != d_sock)
+				continue;
 			if (forward_answer(string(reinterpret_cast<char *>(from), flen), fqdn, query->id, buf, r) != 0)
 				syslog(LOG_INFO, "Failed: %s", this->why());
 			continue;
@@ -256,8 +502,9 @@ int doh_proxy::loop()
 
 		bool has_fwd = 0;
 
-		// check if we need to forward queries of internal domains to internal DNS
-		for (auto it = config::internal_domains.begin(); it != config::internal_domains.end(); ++it) {
+		// check if we need to forward queries of internal domains to internal DNS.
+		// Not for local NSS modules, which don't know about internal domains either.
+		for (auto it = config::internal_domains.begin(); sock == d_sock && it != config::internal_domains.end(); ++it) {
 
 			// is internal domain suffix of fqdn?
 			if (fqdn.size() >= it->first.size() && fqdn.find(it->first) == (fqdn.size() - it->first.size())) {
@@ -271,6 +518,12 @@ int doh_proxy::loop()
 		if (has_fwd)
 			continue;
 
+		if (config::passthrough) {
+			if (passthrough(sock, fqdn, buf, r, from, flen) != 0)
+				syslog(LOG_INFO, "Failed: %s", this->why());
+			continue;
+		}
+
 		// It's important here that qname may not contain compression (qname2host() called
 		// with start_idx = 0). Otherwise qnlen would be wrong.
 
@@ -287,7 +540,7 @@ int doh_proxy::loop()
 				answer.rcode = 3;	// NXDOMAIN
 				reply = string(reinterpret_cast<char *>(&answer), sizeof(answer));
 				reply += string(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
-				sendto(d_sock, reply.c_str(), reply.size(), 0, from, flen);
+				sendto(sock, reply.c_str(), reply.size(), 0, from, flen);
 				continue;
 			}
 		}
@@ -299,12 +552,16 @@ int doh_proxy::loop()
 		result.clear();
 
 		bool rdata_from_cache = 0;
+		uint32_t max_age = dnshttps::no_max_age;
 
 		raw = "";
 
+		timeval start = {0, 0}, end = {0, 0};
+		gettimeofday(&start, nullptr);
+
 		if (cache_lookup(fqdn, qtype, result))
 			rdata_from_cache = 1;
-		else if ((r = dns->get(fqdn, qtype, result, raw)) <= 0) {
+		else if ((r = dns->get(fqdn, qtype, result, raw, max_age)) <= 0) {
 
 			answer.a_count = 0;
 			if (r < 0) {
@@ -315,9 +572,15 @@ int doh_proxy::loop()
 
 			reply = string(reinterpret_cast<char *>(&answer), sizeof(answer));
 			reply += string(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
-			sendto(d_sock, reply.c_str(), reply.size(), 0, from, flen);
+			sendto(sock, reply.c_str(), reply.size(), 0, from, flen);
+
+			if (d_shadow && r == 0) {
+				gettimeofday(&end, nullptr);
+				d_shadow->sample(string(buf, blen), reply, (end.tv_sec - start.tv_sec)*1000000 + end.tv_usec - start.tv_usec);
+			}
 			continue;
 		}
+		gettimeofday(&end, nullptr);
 
 		if (config::log_requests) {
 			string log_type = qtype == htons(dns_type::A) ? "A" : "AAAA";
@@ -335,7 +598,7 @@ int doh_proxy::loop()
 		reply = string(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
 
 		if (!rdata_from_cache)
-			cache_insert(fqdn, qtype, result);
+			cache_insert(fqdn, qtype, result, max_age);
 
 		uint16_t rdlen = 0, n_answers = 0;
 
@@ -365,7 +628,10 @@ int doh_proxy::loop()
 		answer.a_count = htons(n_answers);
 		reply.insert(0, string(reinterpret_cast<char *>(&answer), sizeof(answer)));
 
-		sendto(d_sock, reply.c_str(), reply.size(), 0, from, flen);
+		sendto(sock, reply.c_str(), reply.size(), 0, from, flen);
+
+		if (d_shadow && !rdata_from_cache)
+			d_shadow->sample(string(buf, blen), reply, (end.tv_sec - start.tv_sec)*1000000 + end.tv_usec - start.tv_usec);
 	}
 
 	return 0;
@@ -23,11 +23,15 @@
 
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/socket.h>
 #include <map>
 #include <string>
 #include <cstdint>
 #include <utility>
+#include <tuple>
 #include "dnshttps.h"
+#include "shadow.h"
+#include "shmcache.h"
 
 
 namespace harddns {
@@ -36,6 +40,9 @@ class doh_proxy {
 
 	int d_sock{-1};
 
+	// local NSS modules ask via this Unix datagram socket
+	int d_nss_sock{-1};
+
 	int d_af{0};
 
 	struct cache_elem_t {
@@ -45,10 +52,24 @@ class doh_proxy {
 
 	std::map<std::pair<std::string, uint16_t>, cache_elem_t> d_rr_cache;
 
+	struct wire_elem_t {
+		std::string answer;
+		time_t inserted, valid_until;
+	};
+
+	// passthrough mode answers by lowercased {fqdn, qtype, answer_flavor()}
+	std::map<std::tuple<std::string, uint16_t, uint8_t>, wire_elem_t> d_wire_cache;
+
 	// packet/origin addr
 	std::map<std::string, std::string> d_fwd_cache;
 
-	void cache_insert(const std::string &, uint16_t, const dnshttps::dns_reply &);
+	// harddnsd: copies of sampled queries go to the shadow nameservers
+	shadow *d_shadow{nullptr};
+
+	// harddnsd: A/AAAA answers for the NSS modules to read
+	shm_cache *d_shm{nullptr};
+
+	void cache_insert(const std::string &, uint16_t, const dnshttps::dns_reply &, uint32_t);
 
 	bool cache_lookup(const std::string &, uint16_t, dnshttps::dns_reply &);
 
@@ -56,6 +77,10 @@ class doh_proxy {
 
 	int forward_answer(const std::string &, const std::string &, uint16_t, const char *, size_t);
 
+	void publish_wire(const std::string &, uint16_t, const std::string &, time_t);
+
+	int passthrough(int, const std::string &, const char *, size_t, const sockaddr *, socklen_t);
+
 	// As the dnshttp object we use the globally exported 'dns'
 	// as used for the NSS module
 
@@ -83,6 +108,10 @@ public:
 	virtual ~doh_proxy()
 	{
 		::close(d_sock);
+		if (d_nss_sock >= 0)
+			::close(d_nss_sock);
+		delete d_shadow;
+		delete d_shm;
 	}
 
 	int init(const std::string &, const std::string &);
@@ -0,0 +1,284 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "sessions.h"
+
+extern "C" {
+#include <openssl/ssl.h>
+}
+
+
+namespace harddns {
+
+using namespace std;
+
+
+session_store *ssl_sessions = nullptr;
+
+
+// A session file is a sequence of records:
+// 8bit key length, key, 64bit expiry (host order), 16bit DER length (host order), DER session.
+// It is only ever accessed by the same user on the same host.
+enum { max_file_size = 0x10000, max_der_size = 0x2000 };
+
+
+static bool expired(SSL_SESSION *s, time_t now)
+{
+	return !SSL_SESSION_is_resumable(s) || (time_t)(SSL_SESSION_get_time(s) + SSL_SESSION_get_timeout(s)) <= now;
+}
+
+
+static bool next_record(const string &buf, string::size_type &off, string &key, int64_t &expiry, string &der)
+{
+	uint16_t der_len = 0;
+
+	if (off + 1 > buf.size())
+		return 0;
+	uint8_t key_len = buf[off++];
+	if (off + key_len + sizeof(expiry) + sizeof(der_len) > buf.size())
+		return 0;
+	key = buf.substr(off, key_len);
+	off += key_len;
+	memcpy(&expiry, buf.c_str() + off, sizeof(expiry));
+	off += sizeof(expiry);
+	memcpy(&der_len, buf.c_str() + off, sizeof(der_len));
+	off += sizeof(der_len);
+	if (der_len > max_der_size || off + der_len > buf.size())
+		return 0;
+	der = buf.substr(off, der_len);
+	off += der_len;
+	return 1;
+}
+
+
+static string make_record(const string &key, int64_t expiry, const string &der)
+{
+	uint8_t key_len = key.size();
+	uint16_t der_len = der.size();
+
+	string r = string(1, (char)key_len) + key;
+	r += string(reinterpret_cast<char *>(&expiry), sizeof(expiry));
+	r += string(reinterpret_cast<char *>(&der_len), sizeof(der_len));
+	r += der;
+	return r;
+}
+
+
+static int read_file(int fd, string &buf)
+{
+	char tmp[4096];
+	ssize_t r = 0;
+
+	buf = "";
+	for (off_t off = 0; buf.size() < max_file_size; off += r) {
+		if ((r = pread(fd, tmp, sizeof(tmp), off)) < 0)
+			return -1;
+		if (r == 0)
+			break;
+		buf += string(tmp, r);
+	}
+	return 0;
+}
+
+
+session_store::~session_store()
+{
+	for (auto &s : d_sessions)
+		SSL_SESSION_free(s.second);
+}
+
+
+// Open the per-user session file and lock it. Refuse anything that
+// is not a regular file owned by us and inaccessible by others.
+int session_store::open_file(int lock)
+{
+	string path = d_dir + "/" + to_string(geteuid()) + ".sessions";
+	struct stat st;
+
+	int fd = open(path.c_str(), O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0 ||
+	    flock(fd, lock) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+SSL_SESSION *session_store::load(const string &key)
+{
+	string buf = "", rkey = "", der = "";
+	int64_t expiry = 0;
+	time_t now = time(nullptr);
+	SSL_SESSION *s = nullptr;
+
+	int fd = open_file(LOCK_SH);
+	if (fd < 0)
+		return nullptr;
+	int r = read_file(fd, buf);
+	close(fd);
+
+	if (r < 0)
+		return nullptr;
+
+	for (string::size_type off = 0; next_record(buf, off, rkey, expiry, der);) {
+		if (rkey != key || expiry <= now)
+			continue;
+		const unsigned char *p = reinterpret_cast<const unsigned char *>(der.c_str());
+		if (s)
+			SSL_SESSION_free(s);
+		s = d2i_SSL_SESSION(nullptr, &p, der.size());
+	}
+
+	if (s && expired(s, now)) {
+		SSL_SESSION_free(s);
+		s = nullptr;
+	}
+
+	return s;
+}
+
+
+void session_store::save(const string &key, SSL_SESSION *s)
+{
+	string buf = "", rkey = "", der = "", out = "";
+	int64_t expiry = 0;
+	time_t now = time(nullptr);
+
+	int len = i2d_SSL_SESSION(s, nullptr);
+	if (len <= 0 || len > max_der_size || key.size() > 0xff)
+		return;
+	string sder(len, 0);
+	unsigned char *p = reinterpret_cast<unsigned char *>(&sder[0]);
+	if (i2d_SSL_SESSION(s, &p) != len)
+		return;
+
+	int fd = open_file(LOCK_EX);
+	if (fd < 0)
+		return;
+
+	if (read_file(fd, buf) == 0) {
+		// keep all others that did not expire yet
+		for (string::size_type off = 0; next_record(buf, off, rkey, expiry, der);) {
+			if (rkey != key && expiry > now)
+				out += make_record(rkey, expiry, der);
+		}
+	}
+
+	out += make_record(key, SSL_SESSION_get_time(s) + SSL_SESSION_get_timeout(s), sder);
+
+	// oldest records go first if we grow too large
+	string::size_type off = 0;
+	while (out.size() - off > max_file_size && next_record(out, off, rkey, expiry, der))
+		;
+	if (out.size() - off <= max_file_size) {
+		if (ftruncate(fd, 0) == 0 && pwrite(fd, out.c_str() + off, out.size() - off, 0) < 0)
+			(void)ftruncate(fd, 0);
+	}
+
+	close(fd);
+}
+
+
+// Returns a new reference to a resumable session for key, or nullptr
+SSL_SESSION *session_store::get(const string &key)
+{
+	lock_guard<mutex> g(d_mtx);
+
+	auto it = d_sessions.find(key);
+	if (it != d_sessions.end() && !expired(it->second, time(nullptr))) {
+		SSL_SESSION_up_ref(it->second);
+		return it->second;
+	}
+
+	if (d_dir.empty())
+		return nullptr;
+
+	// maybe another process or an earlier run has one
+	SSL_SESSION *s = load(key);
+	if (!s)
+		return nullptr;
+
+	if (it != d_sessions.end())
+		SSL_SESSION_free(it->second);
+	d_sessions[key] = s;
+
+	SSL_SESSION_up_ref(s);
+	return s;
+}
+
+
+// Takes ownership of the passed reference
+void session_store::put(const string &key, SSL_SESSION *s)
+{
+	if (!s)
+		return;
+
+	lock_guard<mutex> g(d_mtx);
+
+	auto it = d_sessions.find(key);
+	if (it != d_sessions.end()) {
+		// resumed without getting a new ticket
+		if (it->second == s) {
+			SSL_SESSION_free(s);
+			return;
+		}
+		SSL_SESSION_free(it->second);
+	}
+	d_sessions[key] = s;
+
+	if (d_dir.size() && !expired(s, time(nullptr)))
+		save(key, s);
+}
+
+
+// count a finished handshake for key, whether a ticket was offered and whether it
+// was accepted by the server; returns the updated counters
+session_store::stats_t session_store::account(const string &key, bool offered, bool resumed)
+{
+	lock_guard<mutex> g(d_mtx);
+
+	auto &st = d_stats[key];
+	++st.handshakes;
+	if (offered)
+		++st.offered;
+	if (resumed)
+		++st.resumed;
+	return st;
+}
+
+
+}
+
@@ -0,0 +1,86 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_sessions_h
+#define harddns_sessions_h
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <ctime>
+
+extern "C" {
+#include <openssl/ssl.h>
+}
+
+
+namespace harddns {
+
+
+// TLS sessions for resumption, kept in memory and optionally in a per-user
+// file inside a directory, so that they survive restarts and may be shared by
+// the daemon and all NSS consumers running as the same user.
+class session_store {
+
+	std::mutex d_mtx;
+
+	std::map<std::string, SSL_SESSION *> d_sessions;
+
+public:
+
+	struct stats_t {
+		unsigned long handshakes{0}, offered{0}, resumed{0};
+	};
+
+private:
+
+	std::map<std::string, stats_t> d_stats;
+
+	std::string d_dir{""};
+
+	int open_file(int);
+
+	SSL_SESSION *load(const std::string &);
+
+	void save(const std::string &, SSL_SESSION *);
+
+public:
+
+	session_store(const std::string &dir = "")
+		: d_dir(dir)
+	{
+	}
+
+	virtual ~session_store();
+
+	SSL_SESSION *get(const std::string &);
+
+	void put(const std::string &, SSL_SESSION *);
+
+	stats_t account(const std::string &, bool, bool);
+};
+
+
+extern session_store *ssl_sessions;
+
+}
+
+#endif
+
@@ -0,0 +1,212 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <new>
+#include <sys/time.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include "shadow.h"
+#include "dnsmsg.h"
+#include "net-headers.h"
+
+
+namespace harddns {
+
+using namespace std;
+using namespace net_headers;
+
+
+// queued samples beyond that are dropped, and stats are logged every that many queries
+enum { max_jobs = 64, log_every = 100 };
+
+
+// The parts of an answer that are compared: rcode, whether there are answers at all,
+// and the addresses. Returns 0 if the answer can't be parsed.
+static bool summary(string_view answer, int &rcode, bool &has_answers, set<string> &addrs)
+{
+	dns_msg msg(answer);
+	string::size_type qname = 0, idx = string::npos;
+	uint16_t qtype = 0, qclass = 0;
+	dns_msg::rr_t rr;
+
+	addrs.clear();
+	if ((idx = msg.question(qname, qtype, qclass)) == string::npos)
+		return 0;
+
+	rcode = msg.rcode();
+	has_answers = msg.an_count() > 0;
+
+	for (unsigned int i = 0; i < msg.an_count(); ++i) {
+		if ((idx = msg.next_rr(idx, rr)) == string::npos)
+			return 0;
+		if (rr.qtype == htons(dns_type::A) || rr.qtype == htons(dns_type::AAAA))
+			addrs.insert(string(answer.substr(rr.rdata, rr.rdlen)));
+	}
+
+	return 1;
+}
+
+
+shadow::~shadow()
+{
+	if (d_thread.joinable()) {
+		{
+			lock_guard<mutex> g(d_mtx);
+			d_stop = 1;
+		}
+		d_cv.notify_all();
+		d_thread.join();
+	}
+
+	for (auto &u : d_upstreams) {
+		delete u.dns;
+		delete u.box;
+	}
+}
+
+
+// Set up a connection per shadow nameserver. Must be called before chroot,
+// as it loads the CA certs. The pinned keys are taken from box.
+int shadow::init(const ssl_box &box)
+{
+	for (auto &ns : config::shadow_ns) {
+		auto cfg = config::ns_cfg->find(ns);
+		if (cfg == config::ns_cfg->end())
+			continue;
+		if (!cfg->second.rfc8484 && !cfg->second.dot) {
+			syslog(LOG_INFO, "Shadow nameserver %s is neither rfc8484 nor DoT. Ignoring.", ns.c_str());
+			continue;
+		}
+
+		ssl_box *b = new (nothrow) ssl_box(box.sessions());
+		if (!b) {
+			d_err = "shadow::init: OOM";
+			return -1;
+		}
+		if (b->setup_ctx() < 0) {
+			d_err = string("shadow::init:") + b->why();
+			delete b;
+			return -1;
+		}
+		b->share_pinned(box);
+
+		dnshttps *d = new (nothrow) dnshttps(b);
+		if (!d) {
+			delete b;
+			d_err = "shadow::init: OOM";
+			return -1;
+		}
+
+		d_upstreams.push_back({&cfg->second, b, d, 0, 0, 0, 0, 0});
+	}
+
+	return 0;
+}
+
+
+// Called by the proxy after the client got its answer to query, which took rtt usec.
+// Takes every (100/shadow_rate)th query, and never blocks on the shadow queries.
+void shadow::sample(const string &query, const string &answer, long rtt)
+{
+	if (d_upstreams.empty() || config::shadow_rate == 0)
+		return;
+
+	if ((d_acc += config::shadow_rate) < 100)
+		return;
+	d_acc -= 100;
+
+	// started late, after we dropped privileges
+	if (!d_thread.joinable())
+		d_thread = thread(&shadow::worker, this);
+
+	{
+		lock_guard<mutex> g(d_mtx);
+		if (d_jobs.size() >= max_jobs)
+			return;
+		d_jobs.push_back({query, answer, rtt});
+	}
+	d_cv.notify_one();
+}
+
+
+void shadow::run(upstream_t &u, const job_t &job)
+{
+	string answer = "";
+	timeval start = {0, 0}, end = {0, 0};
+
+	gettimeofday(&start, nullptr);
+	int r = u.dns->ask_ns(*u.cfg, job.query, answer);
+	gettimeofday(&end, nullptr);
+
+	++u.queries;
+	u.primary_rtt += job.rtt;
+
+	if (r < 0)
+		++u.errors;
+	else {
+		u.rtt += (end.tv_sec - start.tv_sec)*1000000 + end.tv_usec - start.tv_usec;
+
+		int rc1 = -1, rc2 = -2;
+		bool has1 = 0, has2 = 0;
+		set<string> a1, a2;
+		if (summary(job.answer, rc1, has1, a1) && summary(answer, rc2, has2, a2) &&
+		    rc1 == rc2 && has1 == has2 && a1 == a2)
+			++u.agree;
+	}
+
+	if (u.queries % log_every == 0) {
+		unsigned long ok = u.queries - u.errors;
+		syslog(LOG_INFO, "shadow %s: %lu queries, %lu errors, %.1fms avg (primary %.1fms), %lu%% agree",
+		       u.cfg->ip.c_str(), u.queries, u.errors, ok ? u.rtt/ok/1000 : 0.0, u.primary_rtt/u.queries/1000,
+		       ok ? 100*u.agree/ok : 0);
+	}
+}
+
+
+void shadow::worker()
+{
+	unique_lock<mutex> lck(d_mtx);
+
+	while (!d_stop) {
+		if (d_jobs.empty()) {
+			d_cv.wait(lck);
+			continue;
+		}
+
+		job_t job = d_jobs.front();
+		d_jobs.pop_front();
+		lck.unlock();
+
+		for (auto &u : d_upstreams)
+			run(u, job);
+
+		lck.lock();
+	}
+}
+
+
+}
+
@@ -0,0 +1,98 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_shadow_h
+#define harddns_shadow_h
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "config.h"
+#include "ssl.h"
+#include "dnshttps.h"
+
+
+namespace harddns {
+
+
+// harddnsd: sends copies of a sample of the proxied queries to the shadow nameservers
+// in the background and records their latency, errors and whether they agree
+// with the answer the client got. Their answers are thrown away.
+class shadow {
+
+	struct job_t {
+		std::string query, answer;
+		long rtt;
+	};
+
+	struct upstream_t {
+		const config::a_ns_cfg *cfg;
+		ssl_box *box;
+		dnshttps *dns;
+		unsigned long queries, errors, agree;
+		double rtt, primary_rtt;
+	};
+
+	std::vector<upstream_t> d_upstreams;
+
+	std::deque<job_t> d_jobs;
+
+	std::mutex d_mtx;
+
+	std::condition_variable d_cv;
+
+	std::thread d_thread;
+
+	bool d_stop{0};
+
+	unsigned int d_acc{0};
+
+	std::string d_err{""};
+
+	void worker();
+
+	void run(upstream_t &, const job_t &);
+
+public:
+
+	shadow()
+	{
+	}
+
+	virtual ~shadow();
+
+	int init(const ssl_box &);
+
+	void sample(const std::string &, const std::string &, long);
+
+	const char *why()
+	{
+		return d_err.c_str();
+	}
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,255 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "shmcache.h"
+
+
+namespace harddns {
+
+using namespace std;
+
+
+static const char shm_magic[8] = {'h', 'a', 'r', 'd', 'd', 'n', 's', 0};
+
+enum { shm_version = 1 };
+
+
+static inline char lc(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+
+// lowercase name without trailing dot, and its FNV-1a hash together with qtype
+static bool normalize(const string &name, uint16_t qtype, string &key, uint64_t &h)
+{
+	key = "";
+	h = 0xcbf29ce484222325ULL;
+
+	string::size_type len = name.size();
+	if (len > 0 && name[len - 1] == '.')
+		--len;
+	if (len == 0 || len > 253)
+		return 0;
+
+	for (string::size_type i = 0; i < len; ++i) {
+		key += lc(name[i]);
+		h = (h ^ (uint8_t)key[i])*0x100000001b3ULL;
+	}
+	h = (h ^ (qtype & 0xff))*0x100000001b3ULL;
+	h = (h ^ (qtype >> 8))*0x100000001b3ULL;
+
+	return 1;
+}
+
+
+shm_cache::~shm_cache()
+{
+	if (d_map)
+		munmap(d_map, d_size);
+}
+
+
+// harddnsd: create or take over the cache file at path, which is world readable.
+// Readers that still map an earlier file of the same path keep working with it.
+int shm_cache::create(const string &path)
+{
+	struct stat st;
+
+	d_size = slots_off + nslots*sizeof(slot_t);
+
+	int fd = open(path.c_str(), O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return build_error("create::open:", -1);
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || fchmod(fd, 0644) < 0 ||
+	    ftruncate(fd, d_size) < 0) {
+		close(fd);
+		return build_error("create: Invalid cache file.", -1);
+	}
+
+	void *p = mmap(nullptr, d_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return build_error("create::mmap:", -1);
+	d_map = reinterpret_cast<char *>(p);
+
+	// invalidate what an earlier run left, while readers may be looking
+	for (uint64_t i = 0; i < nslots; ++i) {
+		slot_t *s = slot(i);
+		uint32_t seq = s->seq.load(memory_order_relaxed) | 1;
+		s->seq.store(seq, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		s->expires = 0;
+		s->seq.store(seq + 1, memory_order_release);
+	}
+
+	hdr_t *hdr = reinterpret_cast<hdr_t *>(d_map);
+	hdr->version = shm_version;
+	hdr->nslots = nslots;
+	memcpy(hdr->magic, shm_magic, sizeof(hdr->magic));
+
+	return 0;
+}
+
+
+// NSS: map the cache file of harddnsd read-only
+int shm_cache::attach(const string &path)
+{
+	struct stat st;
+
+	int fd = open(path.c_str(), O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0)
+		return build_error("attach::open:", -1);
+
+	d_size = slots_off + nslots*sizeof(slot_t);
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size < d_size) {
+		close(fd);
+		return build_error("attach: Invalid cache file.", -1);
+	}
+
+	// harddnsd creates it before dropping privileges, so it belongs to root, or to ourself
+	// if we run our own harddnsd. Answers from a file that anyone else could write are not taken.
+	if ((st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & 022) != 0) {
+		close(fd);
+		return build_error("attach: Unsafe owner or mode of cache file.", -1);
+	}
+
+	void *p = mmap(nullptr, d_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return build_error("attach::mmap:", -1);
+	d_map = reinterpret_cast<char *>(p);
+
+	const hdr_t *hdr = reinterpret_cast<const hdr_t *>(d_map);
+	if (memcmp(hdr->magic, shm_magic, sizeof(shm_magic)) != 0 || hdr->version != shm_version || hdr->nslots != nslots) {
+		munmap(d_map, d_size);
+		d_map = nullptr;
+		return build_error("attach: Wrong cache file format.", -1);
+	}
+
+	return 0;
+}
+
+
+// Publish the addresses of name for qtype (in network order, as the A/AAAA rdata) until
+// expires. No addresses means the name is known to have none of this type.
+// Only ever called by a single thread.
+void shm_cache::publish(const string &name, uint16_t qtype, const vector<string> &rdata, time_t expires)
+{
+	string key = "";
+	uint64_t h = 0;
+
+	if (!d_map || !normalize(name, qtype, key, h))
+		return;
+
+	// same entry, or else an expired one, or else the one expiring first
+	uint32_t now = time(nullptr);
+	slot_t *s = nullptr;
+	for (uint64_t i = 0; i < probe; ++i) {
+		slot_t *c = slot(h + i);
+		if (c->hash == h && c->qtype == qtype && c->name_len == key.size() && memcmp(c->name, key.c_str(), key.size()) == 0) {
+			s = c;
+			break;
+		}
+		if (!s || (s->expires > now && c->expires < s->expires))
+			s = c;
+	}
+
+	uint32_t seq = s->seq.load(memory_order_relaxed) | 1;
+	s->seq.store(seq, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	s->expires = expires;
+	s->hash = h;
+	s->qtype = qtype;
+	s->name_len = key.size();
+	memcpy(s->name, key.c_str(), key.size());
+	s->naddr = 0;
+	for (auto &a : rdata) {
+		if (s->naddr == max_addrs || a.size() > sizeof(s->addrs[0]))
+			break;
+		memcpy(s->addrs[s->naddr++], a.c_str(), a.size());
+	}
+
+	s->seq.store(seq + 1, memory_order_release);
+}
+
+
+// Look up the unexpired entry of name and qtype, without any syscall or lock.
+// The remaining ttl is in host order.
+bool shm_cache::lookup(const string &name, uint16_t qtype, entry_t &e) const
+{
+	string key = "";
+	uint64_t h = 0;
+	char sname[256];
+
+	if (!d_map || !normalize(name, qtype, key, h))
+		return 0;
+
+	uint32_t now = time(nullptr);
+
+	for (uint64_t i = 0; i < probe; ++i) {
+		const slot_t *s = slot(h + i);
+
+		// retry a few times if the writer is busy with this slot
+		for (int tries = 0; tries < 4; ++tries) {
+			uint32_t seq = s->seq.load(memory_order_acquire);
+			if (seq & 1)
+				continue;
+
+			uint64_t sh = s->hash;
+			uint16_t sqtype = s->qtype;
+			uint8_t name_len = s->name_len;
+			uint32_t expires = s->expires;
+			e.naddr = s->naddr;
+			memcpy(sname, s->name, sizeof(sname));
+			memcpy(e.addrs, s->addrs, sizeof(e.addrs));
+
+			atomic_thread_fence(memory_order_acquire);
+			if (s->seq.load(memory_order_relaxed) != seq)
+				continue;
+
+			if (sh != h || sqtype != qtype || name_len != key.size() || memcmp(sname, key.c_str(), key.size()) != 0)
+				break;
+			if (expires <= now || e.naddr > max_addrs)
+				return 0;
+			e.ttl = expires - now;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+}
+
@@ -0,0 +1,120 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_shmcache_h
+#define harddns_shmcache_h
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+
+
+namespace harddns {
+
+
+// A/AAAA answers of harddnsd, published in a shared memory file that all NSS modules on
+// the host map read-only. It is a fixed size hash table of slots, each guarded by a
+// sequence counter (seqlock): the single writer makes it odd while updating a slot,
+// readers retry if it was odd or changed while they copied the slot.
+class shm_cache {
+
+public:
+
+	enum { max_addrs = 8, nslots = 4096, probe = 4 };
+
+	struct entry_t {
+		uint32_t ttl;
+		uint8_t naddr;
+		char addrs[max_addrs][16];
+	};
+
+private:
+
+	struct hdr_t {
+		char magic[8];
+		uint32_t version, nslots;
+	};
+
+	struct slot_t {
+		std::atomic<uint32_t> seq;
+		uint32_t expires;
+		uint64_t hash;
+		uint16_t qtype;
+		uint8_t naddr, name_len;
+		char name[256];
+		char addrs[max_addrs][16];
+	};
+
+	enum { slots_off = 64 };
+
+	char *d_map{nullptr};
+
+	size_t d_size{0};
+
+	std::string d_err{""};
+
+	slot_t *slot(uint64_t idx) const
+	{
+		return reinterpret_cast<slot_t *>(d_map + slots_off) + idx % nslots;
+	}
+
+	template<class T>
+	T build_error(const std::string &msg, T r)
+	{
+		d_err = "shm_cache::";
+		d_err += msg;
+		if (errno) {
+			d_err += ":";
+			d_err += strerror(errno);
+		}
+		return r;
+	}
+
+public:
+
+	shm_cache()
+	{
+	}
+
+	virtual ~shm_cache();
+
+	const char *why()
+	{
+		return d_err.c_str();
+	}
+
+	int create(const std::string &);
+
+	int attach(const std::string &);
+
+	void publish(const std::string &, uint16_t, const std::vector<std::string> &, time_t);
+
+	bool lookup(const std::string &, uint16_t, entry_t &) const;
+};
+
+
+}
+
+#endif
+
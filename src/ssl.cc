@@ -19,7 +19,9 @@
  */
 
 #include <map>
+#include <atomic>
 #include <string>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
@@ -31,6 +33,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <syslog.h>
 #include "ssl.h"
 #include "misc.h"
@@ -53,12 +57,79 @@ using namespace std;
 ssl_box *ssl_conn = nullptr;
 
 
+// Threads inside OpenSSL calls. A fork() while one of them holds a lock inside OpenSSL
+// would leave it locked in the child for good, so fork_prepare() waits them out and keeps
+// new ones from entering until the fork is done. Atomics only, as nothing may be left
+// locked in the child either.
+static atomic<unsigned int> openssl_active{0};
 
-static int tcp_connect(const char *host, uint16_t port = 443)
+static atomic<bool> openssl_forking{0};
+
+
+class openssl_section {
+
+	bool d_in{0};
+
+public:
+
+	openssl_section()
+	{
+		enter();
+	}
+
+	~openssl_section()
+	{
+		leave();
+	}
+
+	void enter()
+	{
+		timespec ts = {0, 1000000};	// 1ms
+
+		for (; !d_in;) {
+			++openssl_active;
+			if (!openssl_forking) {
+				d_in = 1;
+				break;
+			}
+			--openssl_active;
+			nanosleep(&ts, nullptr);
+		}
+	}
+
+	void leave()
+	{
+		if (d_in)
+			--openssl_active;
+		d_in = 0;
+	}
+};
+
+
+void ssl_box::fork_prepare()
+{
+	timespec ts = {0, 1000000};	// 1ms
+
+	openssl_forking = 1;
+	while (openssl_active > 0)
+		nanosleep(&ts, nullptr);
+}
+
+
+void ssl_box::fork_release()
+{
+	openssl_forking = 0;
+}
+
+
+
+static int tcp_connect(const char *host, uint16_t port = 443, bool tfo = 1)
 {
 	int sock = -1;
 #ifdef TCP_FASTOPEN_CONNECT
 	int one = 1;
+#else
+	(void)tfo;
 #endif
 	struct sockaddr_in sin;
 	struct sockaddr_in6 sin6;
@@ -69,7 +140,8 @@ static int tcp_connect(const char *host, uint16_t port = 443)
 			return -1;
 		fcntl(sock, F_SETFL, O_RDWR|O_NONBLOCK);
 #ifdef TCP_FASTOPEN_CONNECT
-		setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+		if (tfo)
+			setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
 #endif
 		sin.sin_family = AF_INET;
 		sin.sin_port = htons(port);
@@ -82,7 +154,8 @@ static int tcp_connect(const char *host, uint16_t port = 443)
 			return -1;
 		fcntl(sock, F_SETFL, O_RDWR|O_NONBLOCK);
 #ifdef TCP_FASTOPEN_CONNECT
-		setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+		if (tfo)
+			setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
 #endif
 		sin6.sin6_family = AF_INET6;
 		sin6.sin6_port = htons(port);
@@ -98,18 +171,123 @@ static int tcp_connect(const char *host, uint16_t port = 443)
 }
 
 
-ssl_box::ssl_box()
+static int unix_connect(const string &path)
 {
+	int sock = -1;
+	struct sockaddr_un sun;
+
+	if (path.size() >= sizeof(sun.sun_path))
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path.c_str(), path.size());
+
+	if ((sock = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	fcntl(sock, F_SETFL, O_RDWR|O_NONBLOCK);
+	if (connect(sock, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0 && errno != EINPROGRESS && errno != EAGAIN) {
+		close(sock);
+		return -1;
+	}
+
+	errno = 0;
+	return sock;
+}
+
+
+// rfc8305 Sec. 5 recommended Connection Attempt Delay
+enum { race_delay_us = 250000 };
+
+
+// Happy Eyeballs (rfc8305): connect to the IPv6 one of a and b, and additionally to the
+// IPv4 one if that did not complete after race_delay_us. The first one to complete wins,
+// the other is closed. If one of them fails, we keep waiting for the other. No TFO, as it
+// would let connect() complete before the SYN is even sent. Returns the socket and the
+// winner in won.
+static int tcp_race(const string &a, const string &b, uint16_t port, long to, string &won)
+{
+	int socks[2] = {-1, -1}, err = 0;
+	long left_us = to/1000;
+
+	// rfc8305 Sec. 4: IPv6 goes first
+	bool b_first = a.find(':') == string::npos && b.find(':') != string::npos;
+	const string *hosts[2] = {b_first ? &b : &a, b_first ? &a : &b};
+
+	won = "";
+
+	if ((socks[0] = tcp_connect(hosts[0]->c_str(), port, 0)) < 0 && (socks[1] = tcp_connect(hosts[1]->c_str(), port, 0)) < 0)
+		return -1;
+
+	for (bool started = socks[1] >= 0; left_us > 0;) {
+		long wait_us = started ? left_us : min(left_us, (long)race_delay_us);
+		timeval tv = {(time_t)wait_us/1000000, (suseconds_t)wait_us%1000000};
+
+		fd_set wset;
+		FD_ZERO(&wset);
+		int max = -1;
+		for (int i = 0; i < 2; ++i) {
+			if (socks[i] >= 0) {
+				FD_SET(socks[i], &wset);
+				max = socks[i] > max ? socks[i] : max;
+			}
+		}
+
+		if (max < 0)
+			break;
+
+		timeval before = {0, 0}, after = {0, 0};
+		gettimeofday(&before, nullptr);
+		int r = select(max + 1, nullptr, &wset, nullptr, &tv);
+		gettimeofday(&after, nullptr);
+		left_us -= (after.tv_sec - before.tv_sec)*1000000 + after.tv_usec - before.tv_usec;
+
+		if (r < 0)
+			break;
+
+		for (int i = 0; r > 0 && i < 2; ++i) {
+			if (socks[i] < 0 || !FD_ISSET(socks[i], &wset))
+				continue;
+			socklen_t len = sizeof(err);
+			if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+				close(socks[i]);
+				socks[i] = -1;
+				continue;
+			}
+
+			if (socks[1 - i] >= 0)
+				close(socks[1 - i]);
+			won = *hosts[i];
+			errno = 0;
+			return socks[i];
+		}
+
+		// first one failed or is too slow: start the other one
+		if (!started && (socks[0] < 0 || r == 0)) {
+			started = 1;
+			socks[1] = tcp_connect(hosts[1]->c_str(), port, 0);
+		}
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		if (socks[i] >= 0)
+			close(socks[i]);
+	}
+	return -1;
 }
 
 
 ssl_box::~ssl_box()
 {
+	openssl_section os;
+
 	for (auto p : d_pinned) {
 		EVP_PKEY_free(p);
 	}
-	if (d_ssl)
+	if (d_ssl) {
+		keep_session();
 		SSL_free(d_ssl);
+	}
 	if (d_ssl_ctx)
 		SSL_CTX_free(d_ssl_ctx);
 	::close(d_sock);
@@ -119,6 +297,7 @@ ssl_box::~ssl_box()
 int ssl_box::setup_ctx()
 {
 	const SSL_METHOD *method = nullptr;
+	openssl_section os;
 
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
 	if ((method = TLS_client_method()) == nullptr)
@@ -168,6 +347,13 @@ int ssl_box::setup_ctx()
 
 	SSL_CTX_set_read_ahead(d_ssl_ctx, 0);
 
+	// Let the kernel do the record crypto once the handshake is done.
+	// Not an error if unsupported, it then falls back to userspace crypto.
+	if constexpr (HAVE_KTLS) {
+		if (config::ktls)
+			SSL_CTX_set_options(d_ssl_ctx, KTLS_OP);
+	}
+
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
 	SSL_CTX_set_min_proto_version(d_ssl_ctx, TLS1_2_VERSION);
 #endif
@@ -211,6 +397,25 @@ static int post_connection_check(X509 *x509, const string &peer, string &cn)
 
 
 
+// Providers list many IPs with the same cn/host, which usually share their
+// ticket keys. Key the sessions by that, so a failover to another IP of the
+// same provider can still resume. Servers that don't accept the ticket just
+// do a full handshake and hand out a new one.
+static string session_key(const string &ip, uint16_t port)
+{
+	auto cfg = config::ns_cfg->find(ip);
+	if (cfg == config::ns_cfg->end())
+		return ip;
+
+	// a resumed session carries the peer cert of the first handshake, which must
+	// still pass the cn check of this IP
+	if (cfg->second.cn == "no-cn")
+		return ip;
+
+	return cfg->second.cn + "/" + cfg->second.host + "#" + to_string(port);
+}
+
+
 int ssl_box::connect(const string &host, uint16_t port, string &early_data, long to)
 {
 	int r = 0, err = 0;
@@ -218,15 +423,21 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 	this->close();
 
 	d_ns_ip = host;
+	d_session_key = session_key(host, port);
+
+	// a co-located DoH terminator is talked to without TLS
+	auto cfg = config::ns_cfg->find(host);
+	bool plain = cfg != config::ns_cfg->end() && cfg->second.plain;
 
 	// non-blocking connect
-	if ((d_sock = tcp_connect(host.c_str(), port)) < 0)
+	if (plain && cfg->second.unix_path.size()) {
+		if ((d_sock = unix_connect(cfg->second.unix_path)) < 0)
+			return build_error("connect_ssl::unix_connect", -1);
+	} else if ((d_sock = tcp_connect(host.c_str(), port)) < 0)
 		return build_error("connect_ssl::tcp_connect", -1);
 
 	long us = to/(1000*2);	// half TO for select, other for potential repeated SSL_connect()
-	long waiting = 0;
 	timeval tv = {(time_t)us/1000000, (suseconds_t)us%1000000};
-	timespec ts = {0, 10000000};	// 10ms
 
 	fd_set rset, wset;
 	FD_ZERO(&rset);
@@ -239,21 +450,61 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 	if (getsockopt(d_sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err < 0)
 		return build_error("connect_ssl::getsockopt:", -1);
 
+	if (plain) {
+		d_plain = 1;
+		d_session_key = "";
+		d_last_io = time(nullptr);
+		return 0;
+	}
+
+	return handshake(early_data, to);
+}
+
+
+// Race the TCP connects to two equivalent nameservers of different address families,
+// the IPv6 one first, and do the TLS handshake with the winner, which is peer() then.
+int ssl_box::connect_race(const string &host, const string &alt, uint16_t port, string &early_data, long to)
+{
+	string won = "";
+
+	this->close();
+
+	if ((d_sock = tcp_race(host, alt, port, to/2, won)) < 0)
+		return build_error("connect_race::tcp_race", -1);
+
+	d_ns_ip = won;
+	d_session_key = session_key(won, port);
+
+	if (config::log_requests && won != host)
+		syslog(LOG_INFO, "Happy Eyeballs: %s won over %s", won.c_str(), host.c_str());
+
+	return handshake(early_data, to);
+}
+
+
+// TLS handshake and checks on the connected d_sock
+int ssl_box::handshake(string &early_data, long to)
+{
+	int r = 0, err = 0;
+	long waiting = 0;
+	timespec ts = {0, 10000000};	// 10ms
+	openssl_section os;
+
 	if ((d_ssl = SSL_new(d_ssl_ctx)) == nullptr)
 		return -1;
 	SSL_set_fd(d_ssl, d_sock);
 
 	uint32_t max_early = 0;
 
-	auto it = d_sessions.find(d_ns_ip);
-	if (it != d_sessions.end() && SSL_SESSION_is_resumable(it->second)) {
-		if (SSL_set_session(d_ssl, it->second) != 1)
+	free_ptr<SSL_SESSION> sess(d_store ? d_store->get(d_session_key) : nullptr, SSL_SESSION_free);
+	if (sess.get()) {
+		if (SSL_set_session(d_ssl, sess.get()) != 1)
 			return build_error("connect_ssl::SSL_set_session:", -1);
 		if (config::log_requests)
-			syslog(LOG_INFO, "TLS session ticket found for %s", d_ns_ip.c_str());
+			syslog(LOG_INFO, "TLS session ticket found for %s (%s)", d_ns_ip.c_str(), d_session_key.c_str());
 
 		if constexpr (WANT_TLS_0RTT)
-			max_early = SSL_SESSION_get_max_early_data(it->second);
+			max_early = SSL_SESSION_get_max_early_data(sess.get());
 	}
 
 	if constexpr (WANT_TLS_0RTT) {
@@ -288,7 +539,9 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 		}
 
 		if (r == 0) {
+			os.leave();
 			nanosleep(&ts, nullptr);
+			os.enter();
 			waiting += ts.tv_nsec;
 		} else if (r > 0)
 			break;
@@ -297,6 +550,14 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 	if (r != 1)
 		return build_error("connect_ssl::SSL_connect: Failed to connect in time.", -1);
 
+	if (d_store) {
+		auto st = d_store->account(d_session_key, sess.get() != nullptr, SSL_session_reused(d_ssl) == 1);
+		if (config::log_requests)
+			syslog(LOG_INFO, "TLS session %s by %s, %lu/%lu resumed for %s (%lu handshakes)",
+			       SSL_session_reused(d_ssl) == 1 ? "resumed" : "not resumed", d_ns_ip.c_str(),
+			       st.resumed, st.offered, d_session_key.c_str(), st.handshakes);
+	}
+
 	if ((err = SSL_get_verify_result(d_ssl)) != X509_V_OK)
 		return build_error(X509_verify_cert_error_string(err), -1);
 
@@ -308,6 +569,12 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 	if (post_connection_check(x509.get(), d_ns_ip, cn) != 1)
 		return build_error("connect_ssl::SSL Post connection check failed. CN mismatch:" + cn, -1);
 
+	if constexpr (HAVE_KTLS) {
+		if (config::ktls && config::log_requests)
+			syslog(LOG_INFO, "kTLS for %s: send=%d recv=%d", d_ns_ip.c_str(),
+			       (int)BIO_get_ktls_send(SSL_get_wbio(d_ssl)), (int)BIO_get_ktls_recv(SSL_get_rbio(d_ssl)));
+	}
+
 	if (d_pinned.size() > 0) {
 		EVP_PKEY *peer_key = X509_get_pubkey(x509.get());
 
@@ -330,22 +597,29 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 			return build_error("connect_ssl::Peer X509 not in pinned list!", -1);
 	}
 
+	d_last_io = time(nullptr);
+
 	return 0;
 }
 
 
+// If there ever was a session ticket negotiated
+// by client and server, it will be available at this point.
+// This avoids the usage of SSL_CTX_sess_set_new_cb() which
+// would have no access to class member data.
+void ssl_box::keep_session()
+{
+	if (d_store && d_ssl && d_session_key.size())
+		d_store->put(d_session_key, SSL_get1_session(d_ssl));
+}
+
+
 void ssl_box::close()
 {
-	if (d_ssl) {
+	openssl_section os;
 
-		// If there ever was a session ticket negotiated
-		// by client and server, it will be available at this point.
-		// This avoids the usage of SSL_CTX_sess_set_new_cb() which
-		// would have no access to class member data.
-		auto it = d_sessions.find(d_ns_ip);
-		if (it != d_sessions.end())
-			SSL_SESSION_free(it->second);
-		d_sessions[d_ns_ip] = SSL_get1_session(d_ssl);
+	if (d_ssl) {
+		keep_session();
 		SSL_shutdown(d_ssl);
 		SSL_free(d_ssl);
 	}
@@ -355,37 +629,121 @@ void ssl_box::close()
 		::close(d_sock);
 	d_sock = -1;
 
+	d_plain = 0;
+	d_ns_ip = "";
+	d_unread = "";
+}
+
+
+// In the child after fork(): the connection is still the parent's. Let go of it without
+// a close_notify, which would end it for the parent too. Called from an atfork handler,
+// where any lock of OpenSSL or of the session store may be held by a thread that is gone,
+// so the SSL is leaked rather than freed. recv() already stored the session, and as the
+// SSL is never freed, OpenSSL doesn't mark it as not resumable.
+void ssl_box::abandon()
+{
+	d_ssl = nullptr;
+
+	if (d_sock > -1)
+		::close(d_sock);
+	d_sock = -1;
+
+	d_plain = 0;
 	d_ns_ip = "";
+	d_unread = "";
+}
+
+
+// Check whether an idle connection is still usable without blocking. A peer that
+// closed is noticed by its close_notify or FIN. Anything else that arrived in between,
+// such as session tickets, is consumed by the SSL layer; unexpected data is kept for the next read.
+bool ssl_box::alive()
+{
+	if (!d_ssl && !d_plain)
+		return 0;
+
+	pollfd pfd = {d_sock, POLLIN, 0};
+	int r = poll(&pfd, 1, 0);
+	if (r == 0)
+		return 1;
+	if (r < 0 || (pfd.revents & (POLLERR|POLLNVAL)))
+		return 0;
+
+	char buf[4096] = {0};
+
+	if (d_plain) {
+		if ((r = ::recv(d_sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+			d_unread += string(buf, r);
+		return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+	}
+
+	openssl_section os;
+
+	r = SSL_read(d_ssl, buf, sizeof(buf));
+	switch (SSL_get_error(d_ssl, r)) {
+	case SSL_ERROR_NONE:
+		d_unread += string(buf, r);
+		return 1;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		keep_session();
+		return 1;
+	default:
+		ERR_clear_error();
+		return 0;
+	}
+
+	return 0;
+}
+
+
+void ssl_box::share_pinned(const ssl_box &other)
+{
+	for (auto p : other.d_pinned) {
+		if (EVP_PKEY_up_ref(p) == 1)
+			d_pinned.push_back(p);
+	}
 }
 
 
 ssize_t ssl_box::send(const string &buf, long to)
 {
-	if (!d_ssl)
+	if (!d_ssl && !d_plain)
 		return -1;
 
 	int r = 0, written = 0;
 	long waiting = 0;
 	timespec ts = {0, 10000000};	// 10ms
+	openssl_section os;
 
 	for (;waiting < to;) {
-		r = SSL_write(d_ssl, buf.c_str() + written, buf.size() - written);
-
-		switch (SSL_get_error(d_ssl, r)) {
-		case SSL_ERROR_NONE:
-			break;
-		case SSL_ERROR_WANT_WRITE:
-		case SSL_ERROR_WANT_READ:
-			r = 0;
-			break;
-		case SSL_ERROR_ZERO_RETURN:
-			return build_error("send::SSL_write: Peer closed connection.", -1);
-		default:
-			return build_error("send::SSL_write:", -1);
+		if (d_plain) {
+			if ((r = ::send(d_sock, buf.c_str() + written, buf.size() - written, MSG_NOSIGNAL)) < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					return build_error("send::send:", -1);
+				r = 0;
+			}
+		} else {
+			r = SSL_write(d_ssl, buf.c_str() + written, buf.size() - written);
+
+			switch (SSL_get_error(d_ssl, r)) {
+			case SSL_ERROR_NONE:
+				break;
+			case SSL_ERROR_WANT_WRITE:
+			case SSL_ERROR_WANT_READ:
+				r = 0;
+				break;
+			case SSL_ERROR_ZERO_RETURN:
+				return build_error("send::SSL_write: Peer closed connection.", -1);
+			default:
+				return build_error("send::SSL_write:", -1);
+			}
 		}
 
 		if (r == 0) {
+			os.leave();
 			nanosleep(&ts, nullptr);
+			os.enter();
 			waiting += ts.tv_nsec;
 		} else if (r > 0)
 			written += r;
@@ -394,6 +752,9 @@ ssize_t ssl_box::send(const string &buf, long to)
 			break;
 	}
 
+	if (written > 0)
+		d_last_io = time(nullptr);
+
 	return written;
 }
 
@@ -402,9 +763,14 @@ ssize_t ssl_box::recv(string &s, long to)
 {
 	s = "";
 
-	if (!d_ssl)
+	if (!d_ssl && !d_plain)
 		return -1;
 
+	if (d_unread.size()) {
+		s.swap(d_unread);
+		return s.size();
+	}
+
 	int r = 0;
 	char buf[4096] = {0};
 	long us = to/(1000*2);	// half TO for select, other for potential repeated read's
@@ -422,30 +788,50 @@ ssize_t ssl_box::recv(string &s, long to)
 		return 0;
 	}
 
+	openssl_section os;
+
 	for (; waiting < to/2;) {
-		r = SSL_read(d_ssl, buf, sizeof(buf) - 1);
-		switch (SSL_get_error(d_ssl, r)) {
-		case SSL_ERROR_NONE:
-			break;
-		case SSL_ERROR_WANT_WRITE:
-		case SSL_ERROR_WANT_READ:
-			r = 0;
-			break;
-		case SSL_ERROR_ZERO_RETURN:
-			return build_error("recv::SSL_read: Peer closed connection.", -1);
-		default:
-			return build_error("recv::SSL_read:", -1);
+		if (d_plain) {
+			if ((r = ::recv(d_sock, buf, sizeof(buf) - 1, 0)) == 0)
+				return build_error("recv::recv: Peer closed connection.", -1);
+			if (r < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					return build_error("recv::recv:", -1);
+				r = 0;
+			}
+		} else {
+			r = SSL_read(d_ssl, buf, sizeof(buf) - 1);
+			switch (SSL_get_error(d_ssl, r)) {
+			case SSL_ERROR_NONE:
+				break;
+			case SSL_ERROR_WANT_WRITE:
+			case SSL_ERROR_WANT_READ:
+				r = 0;
+				break;
+			case SSL_ERROR_ZERO_RETURN:
+				return build_error("recv::SSL_read: Peer closed connection.", -1);
+			default:
+				return build_error("recv::SSL_read:", -1);
+			}
 		}
 
 		if (r == 0) {
+			os.leave();
 			nanosleep(&ts, nullptr);
+			os.enter();
 			waiting += ts.tv_nsec;
 		} else if (r > 0)
 			break;
 	}
 
-	if (r > 0)
+	if (r > 0) {
 		s = string(buf, r);
+		d_last_io = time(nullptr);
+
+		// TLS1.3 tickets arrive after the handshake, so pick them up early
+		// in case we are never closed orderly
+		keep_session();
+	}
 
 	return r;
 }
@@ -28,7 +28,9 @@
 #include <string>
 #include <memory>
 #include <cstring>
+#include <ctime>
 #include <stdint.h>
+#include "sessions.h"
 
 extern "C" {
 #include <openssl/ssl.h>
@@ -51,10 +53,22 @@ private:
 	SSL_CTX *d_ssl_ctx{nullptr};
 	SSL *d_ssl{nullptr};
 
-	std::map<std::string, SSL_SESSION *> d_sessions;
+	session_store *d_store{nullptr};
 
 	std::string d_err{""}, d_ns_ip{""};
 
+	// sessions are shared by all IPs of the same provider
+	std::string d_session_key{""};
+
+	// already received data that belongs to the next read
+	std::string d_unread{""};
+
+	// last successful connect, send or recv
+	time_t d_last_io{0};
+
+	// connected without TLS, to a local terminator
+	bool d_plain{0};
+
 	template<class T>
 	T build_error(const std::string &msg, T r)
 	{
@@ -74,9 +88,16 @@ private:
 	}
 
 
+	void keep_session();
+
+	int handshake(std::string &, long);
+
 public:
 
-	ssl_box();
+	ssl_box(session_store *s = nullptr)
+		: d_store(s)
+	{
+	}
 
 	virtual ~ssl_box();
 
@@ -90,22 +111,51 @@ public:
 		d_pinned.push_back(evp);
 	}
 
+	void share_pinned(const ssl_box &);
+
+	session_store *sessions() const
+	{
+		return d_store;
+	}
+
 	int setup_ctx();
 
 	// 1s
 	int connect(const std::string &, uint16_t, std::string&, long to = 1000000000);
 
+	// 1s
+	int connect_race(const std::string &, const std::string &, uint16_t, std::string &, long to = 1000000000);
+
 	// 1s
 	ssize_t send(const std::string &, long to = 1000000000);
 
 	ssize_t recv(std::string &, long to = 1000000000);
 
+	void unread(const std::string &s)
+	{
+		d_unread = s + d_unread;
+	}
+
 	void close();
 
+	void abandon();
+
+	// fork() waits until no thread is inside OpenSSL
+	static void fork_prepare();
+
+	static void fork_release();
+
 	std::string peer()
 	{
 		return d_ns_ip;
 	}
+
+	bool alive();
+
+	time_t idle()
+	{
+		return time(nullptr) - d_last_io;
+	}
 };
 
 
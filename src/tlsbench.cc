@@ -0,0 +1,181 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2016-2023 by Sebastian Krahmer,
+ *                  sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// kTLS throughput benchmark: sends N queries over one warm connection to a rfc8484 or
+// DoT nameserver of harddns.conf, once with userspace crypto and once with `ktls`,
+// and reports the time per query of each run. The handshake is not timed.
+//
+// Large answers are where kTLS may pay off, e.g.
+//   tlsbench -c /etc/harddns -s 9.9.9.9 -n 2000 -t TXT google.com
+// Whether the kernel took the connection over is printed to stderr; without the
+// `tls` module (modprobe tls) both runs use userspace crypto.
+
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "config.h"
+#include "dnshttps.h"
+#include "init.h"
+#include "ssl.h"
+#include "sessions.h"
+#include "net-headers.h"
+
+
+using namespace std;
+using namespace harddns;
+using namespace net_headers;
+
+
+namespace harddns {
+
+// dnshttps.cc
+string make_query(const string &, uint16_t);
+
+}
+
+
+static double now_ms()
+{
+	timespec ts = {0, 0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+
+// Returns ms for n queries, or < 0 if one of them failed
+static double run(const config::a_ns_cfg &cfg, const string &query, unsigned int n, bool ktls, size_t &bytes)
+{
+	config::ktls = ktls;
+
+	ssl_box box(ssl_sessions);
+	if (box.setup_ctx() < 0) {
+		fprintf(stderr, "setup_ctx: %s\n", box.why());
+		return -1;
+	}
+	box.share_pinned(*ssl_conn);
+
+	dnshttps d(&box);
+	string answer = "";
+
+	// connects and warms up
+	if (d.ask_ns(cfg, query, answer) < 0) {
+		fprintf(stderr, "%s: %s\n", cfg.ip.c_str(), d.why());
+		return -1;
+	}
+
+	bytes = answer.size();
+
+	double start = now_ms();
+	for (unsigned int i = 0; i < n; ++i) {
+		if (d.ask_ns(cfg, query, answer) < 0) {
+			fprintf(stderr, "%s: query %u: %s\n", cfg.ip.c_str(), i, d.why());
+			return -1;
+		}
+	}
+	return now_ms() - start;
+}
+
+
+int main(int argc, char **argv)
+{
+	string cfg_base = "/etc/harddns", ns = "";
+	unsigned int n = 1000;
+	uint16_t qtype = dns_type::A;
+	int c = 0;
+
+	while ((c = getopt(argc, argv, "c:s:n:t:")) != -1) {
+		switch (c) {
+		case 'c':
+			cfg_base = optarg;
+			break;
+		case 's':
+			ns = optarg;
+			break;
+		case 'n':
+			n = strtoul(optarg, nullptr, 10);
+			break;
+		case 't':
+			if (strcmp(optarg, "AAAA") == 0)
+				qtype = dns_type::AAAA;
+			else if (strcmp(optarg, "TXT") == 0)
+				qtype = dns_type::TXT;
+			else if (strcmp(optarg, "NS") == 0)
+				qtype = dns_type::NS;
+			else
+				qtype = dns_type::A;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	if (optind >= argc || n == 0) {
+		fprintf(stderr, "Usage: %s [-c cfg dir] [-s nameserver] [-n queries] [-t A|AAAA|TXT|NS] name\n", argv[0]);
+		return 1;
+	}
+
+	harddns_init(cfg_base);
+
+	if (!ssl_conn || !config::ns_cfg) {
+		fprintf(stderr, "Unable to initialize from %s.\n", cfg_base.c_str());
+		return 1;
+	}
+
+	// the first rfc8484 or DoT nameserver, unless given
+	const config::a_ns_cfg *cfg = nullptr;
+	for (auto &i : *config::ns_cfg) {
+		if ((ns.empty() || i.first == ns) && (i.second.rfc8484 || i.second.dot) && !i.second.plain) {
+			cfg = &i.second;
+			break;
+		}
+	}
+	if (!cfg) {
+		fprintf(stderr, "No (such) TLS rfc8484 or DoT nameserver in %s/harddns.conf.\n", cfg_base.c_str());
+		return 1;
+	}
+
+	if constexpr (!HAVE_KTLS)
+		fprintf(stderr, "Built without kTLS support, both runs use userspace crypto.\n");
+
+	// so that ssl_box reports whether kTLS is used
+	openlog("tlsbench", LOG_PERROR, LOG_DAEMON);
+	config::log_requests = 1;
+
+	string query = make_query(argv[optind], htons(qtype));
+	size_t bytes = 0;
+
+	double off = run(*cfg, query, n, 0, bytes);
+	double on = run(*cfg, query, n, 1, bytes);
+	if (off < 0 || on < 0)
+		return 1;
+
+	printf("%s %s, %u queries, %zu byte answers\n", cfg->ip.c_str(), cfg->dot ? "DoT" : "rfc8484", n, bytes);
+	printf("%-6s %10s %12s\n", "ktls", "total ms", "us/query");
+	printf("%-6s %10.1f %12.1f\n", "off", off, off*1000/n);
+	printf("%-6s %10.1f %12.1f\n", "on", on, on*1000/n);
+
+	return 0;
+}